@@ -15,6 +15,18 @@ namespace tokenizer {
 using ChatMessage = std::pair<std::string, std::string>;
 using ChatMessages = std::vector<ChatMessage>;
 
+// Byte range [first, second) of the input text.
+using Offset = std::pair<size_t, size_t>;
+
+// Counters of the model's word cache (see PreTrainedTokenizer::set_cache_capacity).
+struct CacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
 // ==========================================
 // 2. Main Class (PIMPL Wrapper)
 // ==========================================
@@ -30,6 +42,10 @@ public:
 
     // --- Core API ---
     std::vector<int> encode(const std::string& text, bool add_special_tokens = true) const;
+    // Same ids as encode(), plus offsets[i]: the bytes of text that ids[i] was produced from,
+    // traced through normalization and pre-tokenization. Tokens with no source text (bos) get
+    // an empty range.
+    std::vector<int> encode_with_offsets(const std::string& text, std::vector<Offset>& offsets, bool add_special_tokens = true) const;
     std::string decode(const std::vector<int>& ids, bool skip_special_tokens = true) const;
 
     // --- Helpers ---
@@ -61,6 +77,24 @@ public:
     // --- Configuration ---
     void set_clean_up_tokenization_spaces(bool clean);
 
+    // --- Word Cache ---
+    // Bounds the per-word cache used by BPE models. Words not used recently are evicted once either
+    // limit is exceeded. max_entries == 0 disables caching, max_bytes == 0 means no byte limit. Safe
+    // to call while other threads encode.
+    void set_cache_capacity(size_t max_entries, size_t max_bytes = 0);
+    CacheStats cache_stats() const;
+    void clear_cache();
+
+    // --- Parallel Encode ---
+    // Pre-tokens of at least min_bytes (long digit runs, hex dumps, data: URIs) are split into up
+    // to `threads` segments encoded on a shared thread pool, then joined exactly. Byte-level BPE
+    // models only; threads <= 1 turns it off, which is the default.
+    void set_parallel_encode(int threads, size_t min_bytes = 64 << 10);
+
+    // --- Diagnostics ---
+    // Approximate bytes held by the model's auxiliary lookup tables (e.g. the BPE merge table).
+    size_t model_memory_usage() const;
+
 private:
     struct Impl; // Forward declaration
     std::unique_ptr<Impl> impl_;
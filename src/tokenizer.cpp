@@ -12,11 +12,20 @@
 #include <iostream>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <functional>
 #include <cmath>
 #include <oniguruma.h>
 #include <utf8proc/utf8proc.h>
 #include <iostream>
 #include <mutex>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <condition_variable>
+#include <deque>
 #include "ujson.hpp"
 #include "jinja.hpp"
 
@@ -47,8 +56,169 @@ struct Encoding {
     std::vector<int> attention_mask;
 };
 
+// Bytes [offset, offset + length) of a PreTokenizedString buffer.
+struct Span {
+    size_t offset, length;
+};
+
+// The splits are spans of one buffer. Pre-tokenizers that only cut the text refine the span list
+// (see SplitBuilder); those that rewrite it (ByteLevel, Metaspace) write every split into scratch
+// and swap it in. This batch form serves encode_with_offsets(); encode() streams pre-tokens
+// instead (see PreTokenizer::pre_tokenize_stream).
 struct PreTokenizedString {
-    std::vector<std::string> splits;
+    std::string buffer, scratch;
+    std::vector<Span> splits, next_splits;
+    // Kept only when offsets are tracked: align[b] is the range of the input text that byte b of
+    // buffer came from, and scratch_align the same for scratch while it is written.
+    bool track = false;
+    std::vector<Offset> align, scratch_align;
+
+    void reset(const std::string& text) {
+        buffer.assign(text);
+        splits.assign(1, Span{0, text.size()});
+        align.clear();
+    }
+    const char* data(size_t i) const { return buffer.data() + splits[i].offset; }
+    size_t size(size_t i) const { return splits[i].length; }
+};
+
+// Range of the input covered by bytes [begin, end) of the n-byte string aligned by `a` (ranges are
+// in input order); an empty range at the position of byte `begin` when begin == end.
+static Offset span_of(const Offset* a, size_t n, size_t begin, size_t end) {
+    if (begin < end) return Offset(a[begin].first, a[end - 1].second);
+    size_t at = begin < n ? a[begin].first : (n == 0 ? 0 : a[n - 1].second);
+    return Offset(at, at);
+}
+
+static Offset span_of(const std::vector<Offset>& a, size_t begin, size_t end) {
+    return span_of(a.data(), a.size(), begin, end);
+}
+
+// Receives pre-tokens one at a time: the len bytes at data, valid until the call returns. A
+// non-owning reference to a callable that outlives it, so passing a lambda down the pre-tokenizer
+// chain for every unit or piece never allocates, unlike std::function.
+class SplitSink {
+public:
+    template <class F> SplitSink(const F& f) : obj_(&f), call_(&invoke<F>) {}
+    void operator()(const char* data, size_t len) const { call_(obj_, data, len); }
+private:
+    template <class F> static void invoke(const void* f, const char* data, size_t len) { (*static_cast<const F*>(f))(data, len); }
+    const void* obj_;
+    void (*call_)(const void*, const char*, size_t);
+};
+
+// Scratch string for a pre-tokenizer that rewrites pieces while streaming. The rewritten piece
+// must stay intact while the sink runs, and the sink may rewrite again further down the chain,
+// so each nesting depth gets its own buffer from a per-thread pool that keeps its capacity.
+class StreamBuffer {
+    struct Pool { std::deque<std::string> buffers; size_t depth = 0; };
+    static Pool& pool() { static thread_local Pool p; return p; }
+    std::string* buffer_;
+public:
+    StreamBuffer() {
+        Pool& p = pool();
+        if (p.buffers.size() == p.depth) p.buffers.emplace_back();
+        buffer_ = &p.buffers[p.depth++];
+        buffer_->clear();
+    }
+    ~StreamBuffer() { pool().depth--; }
+    StreamBuffer(const StreamBuffer&) = delete;
+    StreamBuffer& operator=(const StreamBuffer&) = delete;
+    std::string& get() { return *buffer_; }
+};
+
+// Alignment sinks for the normalizer loops. NoAlignment compiles away on the plain path;
+// Alignment records, for each byte appended to the output, the input range it came from.
+struct NoAlignment {
+    void clear() {}
+    void copy(size_t, size_t) {}
+    void map(size_t, size_t, size_t) {}
+};
+
+struct Alignment {
+    std::vector<Offset>& ranges;
+    void clear() { ranges.clear(); }
+    // Input bytes [begin, end) copied verbatim
+    void copy(size_t begin, size_t end) { for (size_t i = begin; i < end; ++i) ranges.push_back(Offset(i, i + 1)); }
+    // n output bytes standing in for input bytes [begin, end)
+    void map(size_t begin, size_t end, size_t n) { ranges.insert(ranges.end(), n, Offset(begin, end)); }
+};
+
+// Rebuilds the splits of a PreTokenizedString from pieces of the current ones. A piece is a span
+// of the same buffer unless it joins bytes that are not adjacent there (BertPreTokenizer skips
+// invalid UTF-8 inside a word); such pieces are copied aside and appended to the buffer, with
+// their alignment, by finish().
+class SplitBuilder {
+    PreTokenizedString& pts_;
+    std::vector<size_t> copied_; // pieces whose offset is into extra_
+    std::string extra_;
+    std::vector<Offset> extra_align_;
+    Span cur_;
+    bool cur_copied_;
+
+    // Copies bytes [at, at + len) of the buffer to extra_; returns where they start there.
+    size_t copy(size_t at, size_t len) {
+        size_t start = extra_.size();
+        extra_.append(pts_.buffer, at, len);
+        if (pts_.track) extra_align_.insert(extra_align_.end(), pts_.align.begin() + at, pts_.align.begin() + at + len);
+        return start;
+    }
+public:
+    explicit SplitBuilder(PreTokenizedString& pts) : pts_(pts), cur_{0, 0}, cur_copied_(false) { pts_.next_splits.clear(); }
+    // Appends bytes [pos, pos + len) of split i to the piece being built.
+    void append(size_t i, size_t pos, size_t len) {
+        if (len == 0) return;
+        size_t at = pts_.splits[i].offset + pos;
+        if (cur_.length == 0) { cur_ = Span{at, len}; cur_copied_ = false; return; }
+        if (!cur_copied_ && cur_.offset + cur_.length == at) { cur_.length += len; return; }
+        if (!cur_copied_) { cur_.offset = copy(cur_.offset, cur_.length); cur_copied_ = true; }
+        copy(at, len);
+        cur_.length += len;
+    }
+    // Ends the current piece, dropping it if empty.
+    void push() {
+        if (cur_.length == 0) return;
+        if (cur_copied_) copied_.push_back(pts_.next_splits.size());
+        pts_.next_splits.push_back(cur_);
+        cur_.length = 0;
+    }
+    // Adds bytes [pos, pos + len) of split i as a piece of their own.
+    void add(size_t i, size_t pos, size_t len) { push(); append(i, pos, len); push(); }
+    void finish() {
+        push();
+        for (size_t k : copied_) pts_.next_splits[k].offset += pts_.buffer.size();
+        pts_.buffer += extra_;
+        if (pts_.track) pts_.align.insert(pts_.align.end(), extra_align_.begin(), extra_align_.end());
+        pts_.splits.swap(pts_.next_splits);
+    }
+};
+
+// SplitBuilder's interface over a single text, for streaming: each piece goes to the sink as
+// soon as it ends. A piece joining bytes that are not adjacent is assembled in a buffer.
+class SplitStreamer {
+    const char* text_;
+    const SplitSink& sink_;
+    Span cur_;
+    std::string joined_;
+    bool joining_;
+public:
+    SplitStreamer(const char* text, const SplitSink& sink) : text_(text), sink_(sink), cur_{0, 0}, joining_(false) {}
+    void append(size_t, size_t pos, size_t len) {
+        if (len == 0) return;
+        if (cur_.length == 0) { cur_ = Span{pos, len}; joining_ = false; return; }
+        if (!joining_ && cur_.offset + cur_.length == pos) { cur_.length += len; return; }
+        if (!joining_) { joined_.assign(text_ + cur_.offset, cur_.length); joining_ = true; }
+        joined_.append(text_ + pos, len);
+        cur_.length += len;
+    }
+    void push() {
+        if (cur_.length == 0) return;
+        if (joining_) sink_(joined_.data(), joined_.size());
+        else sink_(text_ + cur_.offset, cur_.length);
+        cur_.length = 0;
+    }
+    void add(size_t i, size_t pos, size_t len) { push(); append(i, pos, len); push(); }
+    void finish() { push(); }
 };
 
 // ==========================================
@@ -58,22 +228,81 @@ struct PreTokenizedString {
 class Normalizer {
 public:
     virtual ~Normalizer() = default;
-    virtual std::string normalize(const std::string& text) const = 0;
+    // Writes the normalized text to out (replacing its contents) and returns true, or returns
+    // false without touching out when text is already normal. Reusing out across calls keeps
+    // steady-state normalization allocation-free.
+    virtual bool normalize_into(const std::string& text, std::string& out) const = 0;
+    // As normalize_into, also setting align[i] to the range of text that out[i] came from.
+    virtual bool normalize_aligned(const std::string& text, std::string& out, std::vector<Offset>& align) const = 0;
+    std::string normalize(const std::string& text) const {
+        std::string out;
+        return normalize_into(text, out) ? out : text;
+    }
+};
+
+// Normalizers written once as `template <class A> bool run(text, out, A align)` over an
+// alignment sink get both entry points from this base.
+template <class Derived>
+class AlignedNormalizer : public Normalizer {
+public:
+    bool normalize_into(const std::string& text, std::string& out) const override {
+        return static_cast<const Derived*>(this)->run(text, out, NoAlignment());
+    }
+    bool normalize_aligned(const std::string& text, std::string& out, std::vector<Offset>& align) const override {
+        return static_cast<const Derived*>(this)->run(text, out, Alignment{align});
+    }
 };
 
 class PreTokenizer {
 public:
     virtual ~PreTokenizer() = default;
     virtual void pre_tokenize(PreTokenizedString& pts) const = 0;
+    // Streaming form used by encode(): hands each pre-token of the len bytes at text to sink as
+    // soon as it is found, in order, so no list of splits is built.
+    virtual void pre_tokenize_stream(const char* text, size_t len, const SplitSink& sink) const = 0;
+};
+
+// Pre-tokenizers that only cut text, written once as
+// `template <class B> void cut(const char* s, size_t len, size_t i, B& out)` over a SplitBuilder
+// (batch; pieces of split i) or a SplitStreamer, get both entry points from this base.
+template <class Derived>
+class CuttingPreTokenizer : public PreTokenizer {
+public:
+    void pre_tokenize(PreTokenizedString& pts) const override {
+        SplitBuilder next(pts);
+        for (size_t i = 0; i < pts.splits.size(); ++i) static_cast<const Derived*>(this)->cut(pts.data(i), pts.size(i), i, next);
+        next.finish();
+    }
+    void pre_tokenize_stream(const char* text, size_t len, const SplitSink& sink) const override {
+        SplitStreamer out(text, sink);
+        static_cast<const Derived*>(this)->cut(text, len, 0, out);
+        out.finish();
+    }
 };
 
 class Model {
 public:
     virtual ~Model() = default;
     virtual std::vector<int> tokenize(const std::string& text) const = 0;
+    // Appends the ids of text to out.
+    virtual void tokenize_into(const std::string& text, std::vector<int>& out) const {
+        std::vector<int> ids = tokenize(text);
+        out.insert(out.end(), ids.begin(), ids.end());
+    }
+    // tokenize_into(), also appending to offsets the byte range of text each new id was built
+    // from. Every byte of text falls in at most one range; bytes the model drops fall in none.
+    virtual void tokenize_with_offsets(const std::string& text, std::vector<int>& out, std::vector<Offset>& offsets) const = 0;
     virtual int token_to_id(const std::string& token) const = 0;
     virtual std::string id_to_token(int id) const = 0;
     virtual size_t vocab_size() const = 0;
+    // Approximate bytes held by auxiliary lookup tables built at load time.
+    virtual size_t memory_usage() const { return 0; }
+    // Word cache controls; models without a cache ignore them.
+    virtual void set_cache_capacity(size_t, size_t) {}
+    virtual CacheStats cache_stats() const { return CacheStats(); }
+    virtual void clear_cache() {}
+    // Splitting of very long pre-tokens across worker threads; models that cannot ignore it.
+    virtual void set_parallel_encode(int, size_t) {}
 };
 
 class PostProcessor {
@@ -104,6 +333,16 @@ static std::string OnigurumaRegexEscape(const std::string& pattern) {
     return escaped;
 }
 
+// Appends the UTF-8 encoding of cp to out.
+static void append_utf8(std::string& out, int32_t cp) {
+    char buf[4]; int n = 0;
+    if (cp <= 0x7F) { buf[n++] = (char)cp; }
+    else if (cp <= 0x7FF) { buf[n++] = (char)(0xC0 | (cp >> 6)); buf[n++] = (char)(0x80 | (cp & 0x3F)); }
+    else if (cp <= 0xFFFF) { buf[n++] = (char)(0xE0 | (cp >> 12)); buf[n++] = (char)(0x80 | ((cp >> 6) & 0x3F)); buf[n++] = (char)(0x80 | (cp & 0x3F)); }
+    else { buf[n++] = (char)(0xF0 | (cp >> 18)); buf[n++] = (char)(0x80 | ((cp >> 12) & 0x3F)); buf[n++] = (char)(0x80 | ((cp >> 6) & 0x3F)); buf[n++] = (char)(0x80 | (cp & 0x3F)); }
+    out.append(buf, n);
+}
+
 static std::string get_token_content(const json& j) {
     if (j.is_string()) return j.get<std::string>();
     if (j.is_object() && j.contains("content")) return j["content"].get<std::string>();
@@ -157,456 +396,2694 @@ public:
     bool is_valid() const { return valid_; }
 
     bool search(const std::string& text, int start_offset, int end_offset, int& match_start, int& match_end) const {
-        if (!valid_ || text.empty()) return false;
-        const uint8_t* str = (const uint8_t*)text.c_str();
+        return search(text.data(), text.size(), start_offset, end_offset, match_start, match_end);
+    }
+
+    // Search in the len bytes at text, which need not be a whole string.
+    bool search(const char* text, size_t len, int start_offset, int end_offset, int& match_start, int& match_end) const {
+        if (!valid_ || len == 0) return false;
+        const uint8_t* str = (const uint8_t*)text;
         const uint8_t* start = str + start_offset;
         const uint8_t* end = str + end_offset;
-        OnigRegion* region = onig_region_new();
-        int r = onig_search((regex_t*)regex_, str, str + text.length(), start, end, region, ONIG_OPTION_NONE);
-        if (r >= 0) {
-            match_start = region->beg[0];
-            match_end = region->end[0];
-            onig_region_free(region, 1);
+        OnigRegion* r = region();
+        if (onig_search((regex_t*)regex_, str, str + len, start, end, r, ONIG_OPTION_NONE) < 0) return false;
+        match_start = r->beg[0];
+        match_end = r->end[0];
+        return true;
+    }
+
+    // Match starting exactly at offset, without scanning forward for another start.
+    bool match(const char* text, size_t len, int offset, int& match_end) const {
+        if (!valid_ || len == 0) return false;
+        const uint8_t* str = (const uint8_t*)text;
+        int n = onig_match((regex_t*)regex_, str, str + len, str + offset, region(), ONIG_OPTION_NONE);
+        if (n < 0) return false;
+        match_end = offset + n;
+        return true;
+    }
+
+    // Successive matches in text, each search resuming where the previous match ended, or one
+    // byte further after an empty match, as the split loops of the pre-tokenizers consume them.
+    // Split patterns usually tile the text, so once a match has started right where the last one
+    // ended the next is first tried anchored: the leftmost match from a position that matches is
+    // the one starting there, and onig_match() skips the search's scan for a start.
+    class Matches {
+    public:
+        Matches(const OnigRegex& regex, const char* text, size_t len) : regex_(regex), text_(text), len_(len), pos_(0), tiling_(false) {}
+
+        bool next(int& match_start, int& match_end) {
+            if (pos_ >= (int)len_) return false;
+            if (tiling_ && regex_.match(text_, len_, pos_, match_end)) match_start = pos_;
+            else if (!regex_.search(text_, len_, pos_, (int)len_, match_start, match_end)) return false;
+            tiling_ = match_start == pos_;
+            pos_ = match_end > match_start ? match_end : match_end + 1;
             return true;
         }
-        onig_region_free(region, 1);
-        return false;
-    }
+
+    private:
+        const OnigRegex& regex_;
+        const char* text_;
+        size_t len_;
+        int pos_;
+        bool tiling_;
+    };
 
 private:
+    // One region per thread, reused by every search instead of allocated per call.
+    static OnigRegion* region() {
+        struct Holder {
+            OnigRegion* r;
+            Holder() : r(onig_region_new()) {}
+            ~Holder() { onig_region_free(r, 1); }
+        };
+        static thread_local Holder holder;
+        return holder.r;
+    }
+
     void* regex_;
     bool valid_;
 };
 
-class NFKCNormalizer : public Normalizer {
+// A split regex run without Oniguruma. search() returns what OnigRegex::search() would on valid
+// UTF-8; callers check valid_utf8() and keep Oniguruma for anything else.
+class SplitMatcher {
 public:
-    std::string normalize(const std::string& text) const override {
-        uint8_t* result = nullptr;
-        ssize_t ret = utf8proc_map((const uint8_t*)text.c_str(), 0, &result, (utf8proc_option_t)(UTF8PROC_NULLTERM | UTF8PROC_STABLE | UTF8PROC_COMPOSE | UTF8PROC_COMPAT));
-        if (ret >= 0 && result) {
-            std::string normalized_text = (const char*)result;
-            free(result);
-            return normalized_text;
+    virtual ~SplitMatcher() = default;
+
+    // Leftmost match starting in [start_offset, end_offset) of the len bytes of valid UTF-8 at text.
+    virtual bool search(const char* text, size_t len, int start_offset, int end_offset, int& match_start, int& match_end) const = 0;
+
+    // A PatternScanner for a well-known pattern, else a RegexDFA, or null if neither applies.
+    static std::shared_ptr<const SplitMatcher> find(const std::string& pattern);
+
+    static bool valid_utf8(const char* s, size_t len) {
+        const uint8_t* p = (const uint8_t*)s;
+        size_t i = 0;
+        int32_t cp;
+        while (i < len) {
+            if (p[i] < 0x80) { ++i; continue; }
+            ssize_t r = utf8proc_iterate(p + i, len - i, &cp);
+            if (r <= 0) return false;
+            i += r;
         }
-        return text; // Return original if normalization fails
+        return true;
     }
-};
 
-class PrependNormalizer : public Normalizer {
-    std::string prepend_;
-public:
-    PrependNormalizer(const std::string& p) : prepend_(p) {}
-    std::string normalize(const std::string& text) const override { return prepend_ + text; }
-};
+protected:
+    // Code point at byte i of valid UTF-8; n is set to its length in bytes.
+    static int32_t decode(const uint8_t* p, size_t i, size_t& n) {
+        uint8_t b = p[i];
+        if (b < 0x80) { n = 1; return b; }
+        if (b < 0xE0) { n = 2; return (b & 0x1F) << 6 | (p[i + 1] & 0x3F); }
+        if (b < 0xF0) { n = 3; return (b & 0x0F) << 12 | (p[i + 1] & 0x3F) << 6 | (p[i + 2] & 0x3F); }
+        n = 4;
+        return (b & 0x07) << 18 | (p[i + 1] & 0x3F) << 12 | (p[i + 2] & 0x3F) << 6 | (p[i + 3] & 0x3F);
+    }
 
-class ReplaceNormalizer : public Normalizer {
-    std::string pattern_, content_;
-public:
-    ReplaceNormalizer(const std::string& p, const std::string& c) : pattern_(p), content_(c) {}
-    std::string normalize(const std::string& text) const override {
-        if (pattern_.empty()) return text;
-        std::string out = text;
-        size_t pos = 0;
-        while ((pos = out.find(pattern_, pos)) != std::string::npos) {
-            out.replace(pos, pattern_.length(), content_);
-            pos += content_.length();
+    // Splits a table over all code points into deduplicated blocks of 256: the value for cp is
+    // blocks[block_of[cp >> 8] * 256 + (cp & 0xFF)].
+    template <class T> static void two_level(const std::vector<T>& flat, std::vector<uint16_t>& block_of, std::vector<T>& blocks) {
+        std::map<std::vector<T>, uint16_t> seen;
+        for (size_t hi = 0; hi < 0x1100; ++hi) {
+            std::vector<T> block(flat.begin() + hi * 256, flat.begin() + hi * 256 + 256);
+            auto it = seen.find(block);
+            if (it == seen.end()) {
+                it = seen.emplace(block, (uint16_t)(blocks.size() / 256)).first;
+                blocks.insert(blocks.end(), block.begin(), block.end());
+            }
+            block_of.push_back(it->second);
         }
-        return out;
     }
 };
 
-class SequenceNormalizer : public Normalizer {
-    std::vector<std::shared_ptr<Normalizer>> normalizers_;
+// Hand-written scanners for the split regexes nearly every model uses: the GPT-2 pattern of
+// ByteLevel, the Llama-3 / Qwen2 / DeepSeek Split patterns and WhitespaceSplit. find() knows a
+// pattern by its exact text; search() then runs in one forward pass without backtracking or
+// allocation. Character classes are read from Oniguruma's own Unicode tables, so both agree on
+// every code point.
+class PatternScanner : public SplitMatcher {
 public:
-    SequenceNormalizer(const std::vector<std::shared_ptr<Normalizer>>& n) : normalizers_(n) {}
-    std::string normalize(const std::string& text) const override {
-        std::string out = text;
-        for (const auto& n : normalizers_) out = n->normalize(out);
-        return out;
+    enum Kind { kGPT2, kLlama3, kQwen2, kDeepSeek, kDigits3, kCJK, kWhitespace };
+
+    explicit PatternScanner(Kind kind) : kind_(kind), classes_(classes()) {}
+
+    // Scanner equivalent to pattern, or null if there is none.
+    static std::shared_ptr<const PatternScanner> find(const std::string& pattern) {
+        static const std::pair<const char*, Kind> known[] = {
+            {"'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+", kGPT2},
+            {"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", kLlama3},
+            {"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", kQwen2},
+            {"[!\\\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\\r\\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+", kDeepSeek},
+            {"\\p{N}{1,3}", kDigits3},
+            {"[\xE4\xB8\x80-\xE9\xBE\xA5\xE3\x81\x80-\xE3\x82\x9F\xE3\x82\xA0-\xE3\x83\xBF]+", kCJK},
+            {"\\s+", kWhitespace},
+        };
+        for (const auto& k : known) {
+            if (pattern == k.first) return std::make_shared<PatternScanner>(k.second);
+        }
+        return nullptr;
     }
-};
 
-class BertNormalizer : public Normalizer {
-    bool clean_text_, handle_chinese_chars_, strip_accents_, lowercase_;
-public:
-    BertNormalizer(bool clean = true, bool chinese = true, bool accents = false, bool lower = true)
-        : clean_text_(clean), handle_chinese_chars_(chinese), strip_accents_(accents), lowercase_(lower) {}
+    bool search(const char* text, size_t len, int start_offset, int end_offset, int& match_start, int& match_end) const override {
+        const uint8_t* p = (const uint8_t*)text;
+        for (size_t i = start_offset; i < (size_t)end_offset; ) {
+            Char c = at(p, len, i);
+            size_t e = match_at(p, len, c);
+            if (e > i) { match_start = (int)i; match_end = (int)e; return true; }
+            i = c.end;
+        }
+        return false;
+    }
 
-    std::string normalize(const std::string& text) const override {
-        std::string out;
-        const uint8_t* ptr = (const uint8_t*)text.c_str();
-        size_t len = text.length(), i = 0;
-        int32_t cp;
-        while (i < len) {
-            ssize_t r = utf8proc_iterate(ptr + i, len - i, &cp);
-            if (r <= 0) { i++; continue; }
-            std::string ch((const char*)ptr + i, r);
+private:
+    enum : uint8_t { kL = 1, kN = 2, kM = 4, kP = 8, kS = 16, kSpace = 32 };
+    struct Char { int32_t cp; uint8_t cls; size_t begin, end; }; // cp is -1 past the end
 
-            // Clean text: remove control chars, replace whitespace
-            if (clean_text_) {
-                if (cp == '\t' || cp == '\n' || cp == '\r' || utf8proc_category(cp) == UTF8PROC_CATEGORY_ZS) {
-                    out += ' '; i += r; continue;
-                }
-                if (cp == 0 || cp == 0xFFFD || utf8proc_category(cp) == UTF8PROC_CATEGORY_CC) { i += r; continue; }
-            }
-
-            // Handle Chinese chars: pad with spaces
-            if (handle_chinese_chars_ && is_chinese_char(cp)) {
-                out += ' '; out += ch; out += ' ';
-                i += r; continue;
-            }
-
-            // Strip accents: decompose and skip combining marks
-            if (strip_accents_) {
-                uint8_t* decomposed = nullptr;
-                ssize_t dlen = utf8proc_map(ptr + i, r, &decomposed, (utf8proc_option_t)(UTF8PROC_DECOMPOSE));
-                if (dlen > 0 && decomposed) {
-                    for (ssize_t j = 0; decomposed[j] != 0;) {
-                        int32_t dcp;
-                        ssize_t dr = utf8proc_iterate(decomposed + j, -1, &dcp);
-                        if (dr <= 0) break;
-                        if (utf8proc_category(dcp) != UTF8PROC_CATEGORY_MN) {
-                            out.append((const char*)decomposed + j, dr);
-                        }
-                        j += dr;
-                    }
-                    free(decomposed);
-                    i += r; continue;
+    // Class bits of every code point: block_of[cp >> 8] selects a deduplicated block of 256.
+    struct Classes { std::vector<uint16_t> block_of; std::vector<uint8_t> bits; };
+
+    static const Classes& classes() {
+        static const Classes t = []() {
+            onig_init();
+            std::vector<uint8_t> flat(0x110000, 0);
+            OnigEncoding enc = ONIG_ENCODING_UTF8;
+            auto add = [&](OnigCtype ctype, uint8_t bit) {
+                OnigCodePoint sb_out;
+                const OnigCodePoint* ranges;
+                if (ONIGENC_GET_CTYPE_CODE_RANGE(enc, ctype, &sb_out, &ranges) != 0) return;
+                for (OnigCodePoint k = 0; k < ranges[0]; ++k) {
+                    for (OnigCodePoint cp = ranges[1 + 2 * k]; cp <= ranges[2 + 2 * k] && cp < 0x110000; ++cp) flat[cp] |= bit;
                 }
-            }
+            };
+            auto prop = [&](const char* name) {
+                return (OnigCtype)ONIGENC_PROPERTY_NAME_TO_CTYPE(enc, (OnigUChar*)name, (OnigUChar*)name + strlen(name));
+            };
+            add(prop("L"), kL); add(prop("N"), kN); add(prop("M"), kM);
+            add(prop("P"), kP); add(prop("S"), kS); add(ONIGENC_CTYPE_SPACE, kSpace);
+            Classes c;
+            two_level(flat, c.block_of, c.bits);
+            return c;
+        }();
+        return t;
+    }
 
-            out += ch;
-            i += r;
+    // Character at byte i of valid UTF-8
+    Char at(const uint8_t* p, size_t len, size_t i) const {
+        if (i >= len) return Char{-1, 0, len, len};
+        size_t n;
+        int32_t cp = decode(p, i, n);
+        return Char{cp, classes_.bits[classes_.block_of[cp >> 8] * 256 + (cp & 0xFF)], i, i + n};
+    }
+
+    // End of the longest run from i of characters with (has ? any : none) of the bits in mask
+    size_t run(const uint8_t* p, size_t len, size_t i, uint8_t mask, bool has = true) const {
+        for (Char c = at(p, len, i); c.cp >= 0 && ((c.cls & mask) != 0) == has; c = at(p, len, c.end)) i = c.end;
+        return i;
+    }
+
+    static size_t newlines(const uint8_t* p, size_t len, size_t i) {
+        while (i < len && (p[i] == '\r' || p[i] == '\n')) ++i;
+        return i;
+    }
+
+    // 's|'t|'re|'ve|'m|'ll|'d from the apostrophe c, optionally case-insensitive; c.begin if none.
+    size_t contraction(const uint8_t* p, size_t len, const Char& c, bool fold) const {
+        auto letter = [fold](int32_t cp) -> int32_t {
+            if (!fold) return cp;
+            if (cp >= 'A' && cp <= 'Z') return cp + 32;
+            return cp == 0x17F ? 's' : cp; // LATIN SMALL LETTER LONG S case-folds to 's'
+        };
+        Char a = at(p, len, c.end);
+        switch (letter(a.cp)) {
+        case 's': case 't': case 'm': case 'd': return a.end;
+        case 'r': case 'v': { Char b = at(p, len, a.end); return letter(b.cp) == 'e' ? b.end : c.begin; }
+        case 'l': { Char b = at(p, len, a.end); return letter(b.cp) == 'l' ? b.end : c.begin; }
         }
-        // Lowercase if needed
-        if (lowercase_) {
-            std::string lower_out;
-            ptr = (const uint8_t*)out.c_str();
-            len = out.length(); i = 0;
-            while (i < len) {
-                ssize_t r = utf8proc_iterate(ptr + i, len - i, &cp);
-                if (r <= 0) { lower_out += out[i++]; continue; }
-                int32_t lc = utf8proc_tolower(cp);
-                char buf[8]; int n = 0;
-                if (lc <= 0x7F) { buf[n++] = (char)lc; }
-                else if (lc <= 0x7FF) { buf[n++] = (char)(0xC0 | (lc >> 6)); buf[n++] = (char)(0x80 | (lc & 0x3F)); }
-                else if (lc <= 0xFFFF) { buf[n++] = (char)(0xE0 | (lc >> 12)); buf[n++] = (char)(0x80 | ((lc >> 6) & 0x3F)); buf[n++] = (char)(0x80 | (lc & 0x3F)); }
-                else { buf[n++] = (char)(0xF0 | (lc >> 18)); buf[n++] = (char)(0x80 | ((lc >> 12) & 0x3F)); buf[n++] = (char)(0x80 | ((lc >> 6) & 0x3F)); buf[n++] = (char)(0x80 | (lc & 0x3F)); }
-                lower_out.append(buf, n);
-                i += r;
-            }
-            return lower_out;
+        return c.begin;
+    }
+
+    // \s*[\r\n]+|\s+(?!\S)|\s+ from c (only the last two when crlf is false); c.begin if none.
+    size_t spaces(const uint8_t* p, size_t len, const Char& c, bool crlf) const {
+        size_t last = c.begin, newline = 0, i = c.begin;
+        bool has_newline = false;
+        for (Char d = c; d.cls & kSpace; d = at(p, len, d.end)) {
+            if (d.cp == '\r' || d.cp == '\n') { newline = d.begin; has_newline = true; }
+            last = d.begin;
+            i = d.end;
         }
-        return out;
+        if (i == c.begin) return i;
+        if (crlf && has_newline) return newline + 1; // backtracks to the last line break
+        if (i == len || last == c.begin) return i;
+        return last; // leave the last space to prefix the next word
     }
-private:
-    static bool is_chinese_char(int32_t cp) {
-        return (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
-               (cp >= 0x20000 && cp <= 0x2A6DF) || (cp >= 0x2A700 && cp <= 0x2B73F) ||
-               (cp >= 0x2B740 && cp <= 0x2B81F) || (cp >= 0x2B820 && cp <= 0x2CEAF) ||
-               (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0x2F800 && cp <= 0x2FA1F);
+
+    // End of the match starting at c, or c.begin when there is none.
+    size_t match_at(const uint8_t* p, size_t len, const Char& c) const {
+        const uint8_t kOther = kSpace | kL | kN; // [^\s\p{L}\p{N}]
+        switch (kind_) {
+        case kGPT2: {
+            if (c.cp == '\'') { size_t e = contraction(p, len, c, false); if (e > c.begin) return e; }
+            Char w = c.cp == ' ' ? at(p, len, c.end) : c; // optional leading space
+            if (w.cls & kL) return run(p, len, w.end, kL);
+            if (w.cls & kN) return run(p, len, w.end, kN);
+            if (w.cp >= 0 && !(w.cls & kOther)) return run(p, len, w.end, kOther, false);
+            return spaces(p, len, c, false);
+        }
+        case kLlama3: case kQwen2: {
+            if (c.cp == '\'') { size_t e = contraction(p, len, c, true); if (e > c.begin) return e; }
+            if (c.cls & kL) return run(p, len, c.end, kL);
+            if (c.cp != '\r' && c.cp != '\n' && !(c.cls & kN)) {
+                Char w = at(p, len, c.end);
+                if (w.cls & kL) return run(p, len, w.end, kL);
+            }
+            if (c.cls & kN) {
+                size_t e = c.end;
+                for (int k = 1; k < (kind_ == kLlama3 ? 3 : 1); ++k) {
+                    Char d = at(p, len, e);
+                    if (!(d.cls & kN)) break;
+                    e = d.end;
+                }
+                return e;
+            }
+            Char w = c;
+            if (c.cp == ' ') { Char d = at(p, len, c.end); if (d.cp >= 0 && !(d.cls & kOther)) w = d; }
+            if (w.cp >= 0 && !(w.cls & kOther)) return newlines(p, len, run(p, len, w.end, kOther, false));
+            return spaces(p, len, c, true);
+        }
+        case kDeepSeek: {
+            auto alpha = [](int32_t cp) { return (cp >= 'A' && cp <= 'Z') || (cp >= 'a' && cp <= 'z'); };
+            bool punct = (c.cp >= 33 && c.cp <= 47) || (c.cp >= 58 && c.cp <= 64) || (c.cp >= 91 && c.cp <= 96) || (c.cp >= 123 && c.cp <= 126);
+            if (punct && alpha(at(p, len, c.end).cp)) {
+                size_t e = c.end;
+                while (e < len && alpha(p[e])) ++e;
+                return e;
+            }
+            if (c.cp >= 0 && c.cp != '\r' && c.cp != '\n' && !(c.cls & (kL | kP | kS))) {
+                Char w = at(p, len, c.end);
+                if (w.cls & (kL | kM)) return run(p, len, w.end, kL | kM);
+            }
+            if (c.cls & (kL | kM)) return run(p, len, c.end, kL | kM);
+            Char w = c.cp == ' ' ? at(p, len, c.end) : c;
+            if (!(w.cls & (kP | kS))) w = c;
+            if (w.cls & (kP | kS)) return newlines(p, len, run(p, len, w.end, kP | kS));
+            return spaces(p, len, c, true);
+        }
+        case kDigits3: {
+            size_t e = c.begin;
+            for (int k = 0; k < 3; ++k) {
+                Char d = at(p, len, e);
+                if (!(d.cls & kN)) break;
+                e = d.end;
+            }
+            return e;
+        }
+        case kCJK: {
+            size_t e = c.begin;
+            for (Char d = c; (d.cp >= 0x4E00 && d.cp <= 0x9FA5) || (d.cp >= 0x3040 && d.cp <= 0x30FF); d = at(p, len, d.end)) e = d.end;
+            return e;
+        }
+        case kWhitespace:
+            return run(p, len, c.begin, kSpace);
+        }
+        return c.begin;
     }
+
+    Kind kind_;
+    const Classes& classes_;
 };
 
-class SequencePreTokenizer : public PreTokenizer {
+// Split patterns no PatternScanner knows, compiled into a DFA. The supported subset covers what
+// tokenizer.json files use: literals, ., classes ([...], \s \d \w and negations, \p{..} and
+// \P{..}), alternation, groups, greedy and lazy * + ? {n,m}, (?i) on literals and one-character
+// lookaheads (?=X) / (?!X). compile() returns null for anything else (anchors, backreferences,
+// lookbehind, possessive quantifiers...), for patterns that can match the empty string, and past
+// the size limits; the caller then keeps Oniguruma.
+//
+// Code points are mapped to equivalence classes (ranges no set of the pattern tells apart) and
+// the DFA steps once per code point. A state is the priority-ordered list of NFA threads of a
+// Pike VM: a thread reaching Match drops every thread of lower priority, so the longest run
+// before the state dies ends at the match a backtracking engine reports first, as in RE2. A
+// lookahead is resolved on the step that reads the character it tests, which is why a
+// transition records whether a match ends just before the character it reads.
+class RegexDFA : public SplitMatcher {
 public:
-    std::vector<std::shared_ptr<PreTokenizer>> pts_;
-    SequencePreTokenizer(const std::vector<std::shared_ptr<PreTokenizer>>& pts) : pts_(pts) {}
-    void pre_tokenize(PreTokenizedString& pts) const override {
-        for (const auto& pt : pts_) pt->pre_tokenize(pts);
+    static std::shared_ptr<const RegexDFA> compile(const std::string& pattern) {
+        Builder b(pattern);
+        int root = b.parse_alt(false);
+        if (!b.ok || b.pos != pattern.size()) return nullptr;
+        std::shared_ptr<RegexDFA> dfa(new RegexDFA());
+        if (!dfa->build(b, root)) return nullptr;
+        return dfa;
     }
-};
 
-class ByteLevelPreTokenizer : public PreTokenizer {
-    bool use_regex_ = false;
-    mutable std::shared_ptr<OnigRegex> regex_;
-public:
-    ByteLevelPreTokenizer(bool use_regex = false) : use_regex_(use_regex) {
-        if (use_regex_) {
-            regex_ = std::make_shared<OnigRegex>("'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+");
+    // A scan that finds no match passes only (position, state) pairs from which no match can end;
+    // they are remembered and a later scan stops on reaching one, so a failing run is read once
+    // rather than once per start.
+    bool search(const char* text, size_t len, int start_offset, int end_offset, int& match_start, int& match_end) const override {
+        const uint8_t* p = (const uint8_t*)text;
+        size_t n;
+        std::unordered_set<uint64_t> dead;
+        for (size_t i = start_offset; i < (size_t)end_offset; i += n) {
+            int c = class_at(p, i, n);
+            if (!can_start_[c]) continue;
+            size_t end = scan(p, len, i, dead, false);
+            if (end > i) { match_start = (int)i; match_end = (int)end; return true; }
+            scan(p, len, i, dead, true);
         }
+        return false;
     }
-    void pre_tokenize(PreTokenizedString& pts) const override {
-        if (use_regex_ && regex_ && regex_->is_valid()) {
-            std::vector<std::string> next_splits;
-            for (const auto& s : pts.splits) {
-                if (s.empty()) continue;
-                int last_pos = 0;
-                while (last_pos < (int)s.size()) {
-                    int match_start = -1, match_end = -1;
-                    if (regex_->search(s, last_pos, (int)s.size(), match_start, match_end)) {
-                        if (match_start > last_pos) {
-                            next_splits.push_back(s.substr(last_pos, match_start - last_pos));
-                        }
-                        if (match_end > match_start) {
-                            next_splits.push_back(s.substr(match_start, match_end - match_start));
-                        }
-                        last_pos = match_end;
-                        if (match_start == match_end) last_pos++;
-                    } else {
-                        next_splits.push_back(s.substr(last_pos));
-                        break;
+
+private:
+    typedef std::vector<std::pair<uint32_t, uint32_t>> CodeSet; // sorted, disjoint, inclusive ranges
+    enum NodeType { kEmpty, kSet, kLook, kConcat, kAlt, kRepeat };
+    struct Node { NodeType type; int set; bool negate; std::vector<int> kids; int min, max; bool greedy; };
+    enum Op { kChar, kLookahead, kSplit, kMatch };
+    struct Inst { Op op; int set; bool negate; int x, y; }; // a Split prefers x
+    static const size_t kMaxInsts = 20000, kMaxStates = 10000;
+
+    static void normalize(CodeSet& s) {
+        std::sort(s.begin(), s.end());
+        CodeSet out;
+        for (const auto& r : s) {
+            if (!out.empty() && r.first <= out.back().second + 1) out.back().second = std::max(out.back().second, r.second);
+            else out.push_back(r);
+        }
+        s.swap(out);
+    }
+
+    static CodeSet complement(const CodeSet& s) {
+        CodeSet out;
+        uint32_t next = 0;
+        for (const auto& r : s) {
+            if (r.first > next) out.push_back({next, r.first - 1});
+            next = r.second + 1;
+        }
+        if (next < 0x110000) out.push_back({next, 0x10FFFF});
+        return out;
+    }
+
+    static bool contains(const CodeSet& s, uint32_t cp) {
+        auto it = std::upper_bound(s.begin(), s.end(), std::make_pair(cp, (uint32_t)0x10FFFF));
+        return it != s.begin() && (--it)->second >= cp;
+    }
+
+    // Code points of an Oniguruma character type, so that both engines agree on every class.
+    static CodeSet ctype_set(int ctype, bool negate) {
+        CodeSet s;
+        OnigCodePoint sb_out;
+        const OnigCodePoint* ranges;
+        if (ONIGENC_GET_CTYPE_CODE_RANGE(ONIG_ENCODING_UTF8, (OnigCtype)ctype, &sb_out, &ranges) != 0) return s;
+        for (OnigCodePoint k = 0; k < ranges[0]; ++k) s.push_back({ranges[1 + 2 * k], std::min<uint32_t>(ranges[2 + 2 * k], 0x10FFFF)});
+        normalize(s);
+        return negate ? complement(s) : s;
+    }
+
+    // Recursive descent parser producing a syntax tree in nodes and the sets it tests in sets.
+    struct Builder {
+        const std::string& re;
+        size_t pos = 0;
+        bool ok = true;
+        std::vector<CodeSet> sets;
+        std::vector<Node> nodes;
+
+        explicit Builder(const std::string& pattern) : re(pattern) { onig_init(); }
+
+        int fail() { ok = false; return -1; }
+        bool at(const char* s) const { return re.compare(pos, strlen(s), s) == 0; }
+        int add(NodeType type, int set = -1, bool negate = false, std::vector<int> kids = std::vector<int>()) {
+            nodes.push_back(Node{type, set, negate, kids, 1, 1, true});
+            return (int)nodes.size() - 1;
+        }
+        int add_set(CodeSet s) {
+            normalize(s);
+            sets.push_back(s);
+            return add(kSet, (int)sets.size() - 1);
+        }
+
+        bool nullable(int n) const {
+            const Node& node = nodes[n];
+            switch (node.type) {
+            case kEmpty: case kLook: return true;
+            case kSet: return false;
+            case kConcat: for (int k : node.kids) { if (!nullable(k)) return false; } return true;
+            case kAlt: for (int k : node.kids) { if (nullable(k)) return true; } return false;
+            case kRepeat: return node.min == 0 || nullable(node.kids[0]);
+            }
+            return true;
+        }
+
+        int parse_alt(bool icase) {
+            std::vector<int> alts(1, parse_concat(icase));
+            while (ok && pos < re.size() && re[pos] == '|') {
+                ++pos;
+                alts.push_back(parse_concat(icase));
+            }
+            if (!ok) return -1;
+            return alts.size() == 1 ? alts[0] : add(kAlt, -1, false, alts);
+        }
+
+        int parse_concat(bool icase) {
+            std::vector<int> items;
+            while (ok && pos < re.size() && re[pos] != '|' && re[pos] != ')') {
+                if (at("(?i)") || at("(?-i)")) {
+                    // As in Oniguruma, an inline option covers the rest of the group, alternatives included
+                    bool on = at("(?i)");
+                    pos += on ? 4 : 5;
+                    items.push_back(parse_alt(on));
+                    break;
+                }
+                int atom = parse_atom(icase);
+                if (ok) items.push_back(parse_repeat(atom));
+            }
+            if (!ok) return -1;
+            if (items.empty()) return add(kEmpty);
+            return items.size() == 1 ? items[0] : add(kConcat, -1, false, items);
+        }
+
+        int parse_atom(bool icase) {
+            char c = re[pos];
+            if (c == '(') return parse_group(icase);
+            if (c == '[') return icase ? fail() : parse_class();
+            if (c == '.') { ++pos; return add_set(complement(CodeSet(1, std::make_pair((uint32_t)'\n', (uint32_t)'\n')))); }
+            if (c == '\\') {
+                CodeSet s;
+                bool single;
+                char e = pos + 1 < re.size() ? re[pos + 1] : 0;
+                // Under (?i) only the classes that are closed under case folding
+                if (!escape(s, single, false) || (icase && !single && !strchr("sSdDwW", e))) return fail();
+                if (!single) return add_set(s);
+                std::string u;
+                append_utf8(u, (int32_t)s[0].first);
+                return literal(s[0].first, icase, u.data(), u.data() + u.size());
+            }
+            if (strchr("^$*+?{})]", c)) return fail(); // anchors, stray quantifiers and literal braces
+            int32_t cp;
+            ssize_t n = utf8proc_iterate((const uint8_t*)re.data() + pos, re.size() - pos, &cp);
+            if (n <= 0) return fail();
+            int r = literal(cp, icase, re.data() + pos, re.data() + re.size());
+            pos += n;
+            return r;
+        }
+
+        // Character cp spelled at [p, end), with its case variants under (?i). A fold that spans
+        // several characters on either side ("ss" and U+00DF) is left to Oniguruma.
+        int literal(uint32_t cp, bool icase, const char* p, const char* end) {
+            CodeSet s(1, std::make_pair(cp, cp));
+            if (icase) {
+                std::string u;
+                append_utf8(u, (int32_t)cp);
+                OnigCaseFoldCodeItem items[ONIGENC_GET_CASE_FOLD_CODES_MAX_NUM];
+                int n = ONIGENC_GET_CASE_FOLD_CODES_BY_STR(ONIG_ENCODING_UTF8, ONIGENC_CASE_FOLD_DEFAULT, (OnigUChar*)p, (OnigUChar*)end, items);
+                for (int k = 0; k < n; ++k) {
+                    if (items[k].code_len != 1 || items[k].byte_len != (int)u.size()) return fail();
+                    s.push_back(std::make_pair((uint32_t)items[k].code[0], (uint32_t)items[k].code[0]));
+                }
+            }
+            return add_set(s);
+        }
+
+        int parse_group(bool icase) {
+            if (at("(?=") || at("(?!")) {
+                bool negate = re[pos + 2] == '!';
+                pos += 3;
+                int inner = parse_alt(icase);
+                if (!ok || pos >= re.size() || re[pos] != ')' || nodes[inner].type != kSet) return fail();
+                ++pos;
+                return add(kLook, nodes[inner].set, negate);
+            }
+            if (at("(?:")) pos += 3;
+            else if (at("(?i:")) { icase = true; pos += 4; }
+            else if (at("(?-i:")) { icase = false; pos += 5; }
+            else if (at("(?")) return fail();
+            else ++pos;
+            int inner = parse_alt(icase);
+            if (!ok || pos >= re.size() || re[pos] != ')') return fail();
+            ++pos;
+            return inner;
+        }
+
+        int parse_repeat(int atom) {
+            if (!ok || pos >= re.size()) return atom;
+            int min, max;
+            bool fixed = false;
+            char c = re[pos];
+            if (c == '*') { min = 0; max = -1; ++pos; }
+            else if (c == '+') { min = 1; max = -1; ++pos; }
+            else if (c == '?') { min = 0; max = 1; ++pos; }
+            else if (c == '{') {
+                size_t p = pos + 1;
+                auto number = [&](int& v) {
+                    size_t digits = p;
+                    for (v = 0; p < re.size() && isdigit((unsigned char)re[p]) && v <= 1000; ++p) v = v * 10 + (re[p] - '0');
+                    return p > digits && v <= 1000;
+                };
+                if (!number(min)) return fail();
+                max = min;
+                fixed = p < re.size() && re[p] == '}';
+                if (!fixed) {
+                    if (p >= re.size() || re[p++] != ',') return fail();
+                    if (p < re.size() && re[p] == '}') max = -1;
+                    else if (!number(max) || max < min) return fail();
+                }
+                if (p >= re.size() || re[p] != '}') return fail();
+                pos = p + 1;
+            }
+            else return atom;
+            bool greedy = true;
+            if (pos < re.size() && re[pos] == '?') {
+                if (fixed) return fail(); // {n}? means ({n})? in Oniguruma syntax
+                greedy = false;
+                ++pos;
+            }
+            // Possessive or stacked quantifiers, repeated lookaheads and loops that can spin on
+            // the empty string stay with Oniguruma
+            if (pos < re.size() && strchr("*+?{", re[pos])) return fail();
+            if (nodes[atom].type == kLook || nullable(atom)) return fail();
+            int n = add(kRepeat, -1, false, std::vector<int>(1, atom));
+            nodes[n].min = min;
+            nodes[n].max = max;
+            nodes[n].greedy = greedy;
+            return n;
+        }
+
+        int parse_class() {
+            ++pos;
+            bool negate = pos < re.size() && re[pos] == '^';
+            if (negate) ++pos;
+            CodeSet s;
+            for (bool first = true; ; first = false) {
+                if (pos >= re.size()) return fail();
+                if (re[pos] == ']' && !first) break;
+                if (re[pos] == '[' || re[pos] == ']' || at("&&")) return fail(); // nested classes and intersections
+                CodeSet item;
+                bool single;
+                if (!class_atom(item, single)) return fail();
+                if (pos + 1 < re.size() && re[pos] == '-' && re[pos + 1] != ']') {
+                    ++pos;
+                    CodeSet hi;
+                    bool hi_single;
+                    if (!single || re[pos] == '[' || !class_atom(hi, hi_single) || !hi_single || hi[0].first < item[0].first) return fail();
+                    item[0].second = hi[0].first;
+                }
+                s.insert(s.end(), item.begin(), item.end());
+            }
+            ++pos;
+            normalize(s);
+            return add_set(negate ? complement(s) : s);
+        }
+
+        bool class_atom(CodeSet& s, bool& single) {
+            if (re[pos] == '\\') return escape(s, single, true);
+            int32_t cp;
+            ssize_t n = utf8proc_iterate((const uint8_t*)re.data() + pos, re.size() - pos, &cp);
+            if (n <= 0) return false;
+            pos += n;
+            s.assign(1, std::make_pair((uint32_t)cp, (uint32_t)cp));
+            single = true;
+            return true;
+        }
+
+        // \s \S \d \D \w \W \p{..} \P{..}, or a single character (single = true) for \r \n \t \f,
+        // \xHH below 0x80, \x{H..} and escaped ASCII punctuation.
+        bool escape(CodeSet& s, bool& single, bool in_class) {
+            if (pos + 1 >= re.size()) return false;
+            char c = re[pos + 1];
+            pos += 2;
+            single = false;
+            uint32_t cp;
+            switch (c) {
+            case 's': case 'S': s = ctype_set(ONIGENC_CTYPE_SPACE, c == 'S'); return true;
+            case 'd': case 'D': s = ctype_set(ONIGENC_CTYPE_DIGIT, c == 'D'); return true;
+            case 'w': case 'W':
+                s = ctype_set(ONIGENC_CTYPE_WORD, false);
+                if (!in_class) {
+                    // Outside a class Oniguruma tests \w against its ISO-8859-1 table below U+0100
+                    CodeSet word;
+                    for (uint32_t cp = 0; cp < 0x100; ++cp) {
+                        if (ONIGENC_IS_CODE_CTYPE(ONIG_ENCODING_UTF8, cp, ONIGENC_CTYPE_WORD)) word.push_back(std::make_pair(cp, cp));
                     }
+                    for (const auto& r : s) {
+                        if (r.second >= 0x100) word.push_back(std::make_pair(std::max<uint32_t>(r.first, 0x100), r.second));
+                    }
+                    normalize(word);
+                    s.swap(word);
+                }
+                if (c == 'W') s = complement(s);
+                return true;
+            case 'p': case 'P': {
+                size_t close = re.find('}', pos);
+                if (pos >= re.size() || re[pos] != '{' || close == std::string::npos) return false;
+                bool negate = c == 'P';
+                size_t name = pos + 1;
+                if (name < close && re[name] == '^') { negate = !negate; ++name; }
+                int ctype = ONIGENC_PROPERTY_NAME_TO_CTYPE(ONIG_ENCODING_UTF8, (OnigUChar*)re.data() + name, (OnigUChar*)re.data() + close);
+                if (ctype < 0) return false;
+                pos = close + 1;
+                s = ctype_set(ctype, negate);
+                return !s.empty();
+            }
+            case 'r': cp = '\r'; break;
+            case 'n': cp = '\n'; break;
+            case 't': cp = '\t'; break;
+            case 'f': cp = '\f'; break;
+            case 'x': {
+                bool braced = pos < re.size() && re[pos] == '{';
+                size_t p = pos + braced, digits = p;
+                for (cp = 0; p < re.size() && isxdigit((unsigned char)re[p]) && (braced ? p - digits < 6 : p - digits < 2); ++p) {
+                    cp = cp * 16 + (isdigit((unsigned char)re[p]) ? re[p] - '0' : (tolower((unsigned char)re[p]) - 'a' + 10));
                 }
+                if (braced ? (p == digits || p >= re.size() || re[p] != '}' || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+                           : (p - digits != 2 || cp >= 0x80)) return false; // \x80 and up are raw bytes
+                pos = p + braced;
+                break;
             }
-            pts.splits = next_splits;
+            default:
+                if ((unsigned char)c >= 0x80 || isalnum((unsigned char)c)) return false;
+                cp = (uint8_t)c;
+            }
+            s.assign(1, std::make_pair(cp, cp));
+            single = true;
+            return true;
         }
-        static auto byte_map = create_bytes_char_map();
-        for (auto& s : pts.splits) {
-            std::string out;
-            for (unsigned char b : s) out += byte_map[b];
-            s = out;
+    };
+
+    // Subset construction over priority-ordered thread lists.
+    struct Powerset {
+        const std::vector<Inst>& prog;
+        const std::vector<std::vector<bool>>& member; // member[class][set]
+        std::vector<int> seen_next, seen_look;
+        int stamp;
+
+        Powerset(const std::vector<Inst>& p, const std::vector<std::vector<bool>>& m)
+            : prog(p), member(m), seen_next(p.size(), -1), seen_look(p.size(), -1), stamp(0) {}
+
+        // Char, Lookahead and Match instructions reachable from pc through Splits, by priority
+        void closure(int pc, std::vector<int>& out, std::vector<int>& seen, int mark) const {
+            std::vector<int> stack(1, pc);
+            while (!stack.empty()) {
+                pc = stack.back();
+                stack.pop_back();
+                if (seen[pc] == mark) continue;
+                seen[pc] = mark;
+                const Inst& in = prog[pc];
+                if (in.op == kSplit) { stack.push_back(in.y); stack.push_back(in.x); }
+                else out.push_back(pc);
+            }
         }
-    }
-};
 
-class DigitsPreTokenizer : public PreTokenizer {
-    bool individual_digits_;
-public:
-    DigitsPreTokenizer(bool id) : individual_digits_(id) {}
-    void pre_tokenize(PreTokenizedString& pts) const override {
-        std::vector<std::string> next_splits;
-        for (const auto& s : pts.splits) {
-            std::string current;
-            for (size_t i = 0; i < s.length(); ) {
-                int32_t cp;
-                int len = utf8proc_iterate((const uint8_t*)s.data() + i, s.size() - i, &cp);
-                if (len <= 0) break;
-                std::string c = s.substr(i, len);
-                bool is_digit = (c.length() == 1 && c[0] >= '0' && c[0] <= '9');
-                if (is_digit && individual_digits_) {
-                    if (!current.empty()) { next_splits.push_back(current); current.clear(); }
-                    next_splits.push_back(c);
-                } else {
-                    current += c;
+        // Threads after reading class c (member.size() for the end of the text); returns whether
+        // a match ends before c.
+        bool step(const std::vector<int>& threads, size_t c, std::vector<int>& next) {
+            next.clear();
+            bool matched = false;
+            visit(threads, c, next, ++stamp, matched);
+            return matched;
+        }
+
+        // False once a Match has cut the threads of lower priority.
+        bool visit(const std::vector<int>& threads, size_t c, std::vector<int>& next, int mark, bool& matched) {
+            for (int pc : threads) {
+                const Inst& in = prog[pc];
+                if (in.op == kMatch) { matched = true; return false; }
+                bool in_set = c < member.size() && member[c][in.set];
+                if (in.op == kChar) {
+                    if (in_set) closure(in.x, next, seen_next, mark);
+                } else if (in_set != in.negate) { // the lookahead holds: continue at this priority
+                    std::vector<int> now;
+                    closure(in.x, now, seen_look, ++stamp);
+                    if (!visit(now, c, next, mark, matched)) return false;
                 }
-                i += len;
             }
-            if (!current.empty()) next_splits.push_back(current);
+            return true;
+        }
+    };
+
+    RegexDFA() : num_classes_(0) {}
+
+    // Compiles node n in front of instruction next; returns its entry, or -1 past kMaxInsts.
+    static int emit(const Builder& b, int n, int next, std::vector<Inst>& prog) {
+        if (next < 0 || prog.size() > kMaxInsts) return -1;
+        const Node& node = b.nodes[n];
+        switch (node.type) {
+        case kEmpty: return next;
+        case kSet: case kLook:
+            prog.push_back(Inst{node.type == kSet ? kChar : kLookahead, node.set, node.negate, next, -1});
+            return (int)prog.size() - 1;
+        case kConcat:
+            for (size_t k = node.kids.size(); k-- > 0; ) next = emit(b, node.kids[k], next, prog);
+            return next;
+        case kAlt: {
+            int tail = emit(b, node.kids.back(), next, prog);
+            for (size_t k = node.kids.size() - 1; k-- > 0 && tail >= 0; ) {
+                int head = emit(b, node.kids[k], next, prog);
+                if (head < 0) return -1;
+                prog.push_back(Inst{kSplit, -1, false, head, tail});
+                tail = (int)prog.size() - 1;
+            }
+            return tail;
+        }
+        case kRepeat: {
+            int tail = next;
+            if (node.max < 0) {
+                prog.push_back(Inst{kSplit, -1, false, -1, -1});
+                int loop = (int)prog.size() - 1;
+                int body = emit(b, node.kids[0], loop, prog);
+                if (body < 0) return -1;
+                prog[loop].x = node.greedy ? body : next;
+                prog[loop].y = node.greedy ? next : body;
+                tail = loop;
+            }
+            // Optional copies nest, so skipping one skips the rest: (x(x)?)?
+            for (int k = node.min; k < node.max && tail >= 0; ++k) {
+                int body = emit(b, node.kids[0], tail, prog);
+                if (body < 0) return -1;
+                prog.push_back(Inst{kSplit, -1, false, node.greedy ? body : next, node.greedy ? next : body});
+                tail = (int)prog.size() - 1;
+            }
+            for (int k = 0; k < node.min && tail >= 0; ++k) tail = emit(b, node.kids[0], tail, prog);
+            return tail;
+        }
+        }
+        return -1;
+    }
+
+    bool build(const Builder& b, int root) {
+        std::vector<Inst> prog(1, Inst{kMatch, -1, false, -1, -1});
+        int start = emit(b, root, 0, prog);
+        if (start < 0 || prog.size() > kMaxInsts) return false;
+
+        // Equivalence classes: code points in the same sets share a class
+        std::vector<uint32_t> cuts{0, 0x110000};
+        for (const CodeSet& s : b.sets) {
+            for (const auto& r : s) { cuts.push_back(r.first); cuts.push_back(r.second + 1); }
+        }
+        std::sort(cuts.begin(), cuts.end());
+        cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+        std::map<std::vector<bool>, uint16_t> ids;
+        std::vector<std::vector<bool>> member;
+        std::vector<uint16_t> flat(0x110000);
+        for (size_t k = 0; k + 1 < cuts.size(); ++k) {
+            std::vector<bool> sig(b.sets.size());
+            for (size_t j = 0; j < b.sets.size(); ++j) sig[j] = contains(b.sets[j], cuts[k]);
+            auto it = ids.find(sig);
+            if (it == ids.end()) {
+                if (member.size() >= 0xFFFF) return false;
+                it = ids.emplace(sig, (uint16_t)member.size()).first;
+                member.push_back(sig);
+            }
+            std::fill(flat.begin() + cuts[k], flat.begin() + cuts[k + 1], it->second);
+        }
+        num_classes_ = member.size();
+        two_level(flat, block_of_, classes_);
+
+        // States are discovered breadth first; trans_[state * (classes + 1) + class] holds
+        // (next state + 1) << 1 | a match ends before class, with the end of the text last
+        Powerset ps(prog, member);
+        std::map<std::vector<int>, int> state_ids;
+        std::vector<std::vector<int>> states(1);
+        ps.closure(start, states[0], ps.seen_next, ++ps.stamp);
+        state_ids[states[0]] = 0;
+        size_t width = num_classes_ + 1;
+        std::vector<int> threads, next;
+        for (size_t s = 0; s < states.size(); ++s) {
+            threads = states[s];
+            trans_.resize((s + 1) * width);
+            for (size_t c = 0; c < width; ++c) {
+                bool matched = ps.step(threads, c, next);
+                int id = -1;
+                if (c < num_classes_ && !next.empty()) {
+                    auto it = state_ids.find(next);
+                    if (it == state_ids.end()) {
+                        if (states.size() >= kMaxStates) return false;
+                        it = state_ids.emplace(next, (int)states.size()).first;
+                        states.push_back(next);
+                    }
+                    id = it->second;
+                }
+                trans_[s * width + c] = (id + 1) << 1 | (matched ? 1 : 0);
+            }
+        }
+        // Callers step over empty matches byte by byte, which only Oniguruma handles
+        for (size_t c = 0; c < width; ++c) {
+            if (trans_[c] & 1) return false;
+        }
+        can_start_.resize(num_classes_);
+        for (size_t c = 0; c < num_classes_; ++c) can_start_[c] = trans_[c] != 0;
+        return true;
+    }
+
+    // End of the match starting at i, or i if there is none. Stops at a pair in dead; with record
+    // set, adds the pairs it passes to dead instead.
+    size_t scan(const uint8_t* p, size_t len, size_t i, std::unordered_set<uint64_t>& dead, bool record) const {
+        size_t width = num_classes_ + 1, best = i, j = i, m;
+        for (int32_t state = 0; state >= 0; j += m) {
+            if (j > i) {
+                uint64_t key = (uint64_t)j << 32 | (uint32_t)state;
+                if (record ? !dead.insert(key).second : !dead.empty() && dead.count(key)) break;
+            }
+            if (j >= len) {
+                if (trans_[state * width + num_classes_] & 1) best = j;
+                break;
+            }
+            int32_t t = trans_[state * width + class_at(p, j, m)];
+            if (t & 1) best = j;
+            state = (t >> 1) - 1;
+        }
+        return best;
+    }
+
+    int class_at(const uint8_t* p, size_t i, size_t& n) const {
+        int32_t cp = decode(p, i, n);
+        return classes_[block_of_[cp >> 8] * 256 + (cp & 0xFF)];
+    }
+
+    size_t num_classes_;
+    std::vector<uint16_t> block_of_, classes_;
+    std::vector<int32_t> trans_;
+    std::vector<uint8_t> can_start_;
+};
+
+std::shared_ptr<const SplitMatcher> SplitMatcher::find(const std::string& pattern) {
+    if (auto scanner = PatternScanner::find(pattern)) return scanner;
+    // The DFA tables span all of Unicode, so each pattern is compiled once per process
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<const SplitMatcher>> compiled;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = compiled.find(pattern);
+    if (it == compiled.end()) it = compiled.emplace(pattern, RegexDFA::compile(pattern)).first;
+    return it->second;
+}
+
+// Calls f(match_start, match_end) for each match of a split pattern in the len bytes at s, through
+// matcher when there is one and s is valid UTF-8, else through Oniguruma. Each search resumes at
+// the end of the previous match, or one byte further after an empty one.
+template <class F> static void for_each_match(const OnigRegex& regex, const SplitMatcher* matcher, const char* s, size_t len, F f) {
+    int match_start, match_end;
+    if (matcher && SplitMatcher::valid_utf8(s, len)) {
+        for (int pos = 0; pos < (int)len && matcher->search(s, len, pos, (int)len, match_start, match_end); ) {
+            f(match_start, match_end);
+            pos = match_end > match_start ? match_end : match_end + 1;
+        }
+        return;
+    }
+    OnigRegex::Matches matches(regex, s, len);
+    while (matches.next(match_start, match_end)) f(match_start, match_end);
+}
+
+// NFKC, or NFKD with compose = false. A quick check first walks the text for code points that
+// normalization leaves alone and that cannot combine with what precedes them; only the spans
+// around other code points go through utf8proc, and text that passes unchanged is returned as is.
+// As with utf8proc_map(UTF8PROC_NULLTERM), input stops at the first NUL and invalid UTF-8 is
+// returned untouched: run() then returns false without writing to out or align.
+class NFKCNormalizer : public AlignedNormalizer<NFKCNormalizer> {
+    bool compose_;
+
+    utf8proc_option_t options() const {
+        return (utf8proc_option_t)(UTF8PROC_STABLE | UTF8PROC_COMPAT | (compose_ ? UTF8PROC_COMPOSE : UTF8PROC_DECOMPOSE));
+    }
+
+    // Unchanged by normalization and never reordered or composed with the code point before it.
+    bool is_stable(int32_t cp) const {
+        if (cp >= 0x1100 && cp <= 0x11FF) return false; // conjoining jamo compose algorithmically
+        if (cp >= 0xAC00 && cp <= 0xD7A3) return compose_; // Hangul syllables decompose for NFKD
+        const utf8proc_property_t* prop = utf8proc_get_property(cp);
+        if (prop->combining_class != 0 || prop->comb_issecond) return false;
+        if (prop->decomp_seqindex == UINT16_MAX) return true;
+        // A precomposed letter (canonical mapping, not excluded) recomposes to itself under NFKC
+        // unless a piece of its decomposition has a compatibility mapping of its own.
+        if (!compose_ || prop->decomp_type != 0 || prop->comp_exclusion) return false;
+        const std::vector<int32_t>& ok = self_composing();
+        return std::binary_search(ok.begin(), ok.end(), cp);
+    }
+
+    // Precomposed starters whose NFKC form is themselves, found once by brute force.
+    static const std::vector<int32_t>& self_composing() {
+        static const std::vector<int32_t> table = []() {
+            std::vector<int32_t> t;
+            utf8proc_option_t opts = (utf8proc_option_t)(UTF8PROC_STABLE | UTF8PROC_COMPAT | UTF8PROC_COMPOSE);
+            for (int32_t cp = 0; cp < 0x110000; ++cp) {
+                const utf8proc_property_t* prop = utf8proc_get_property(cp);
+                if (prop->decomp_seqindex == UINT16_MAX || prop->decomp_type != 0 || prop->comp_exclusion) continue;
+                utf8proc_int32_t buf[32];
+                utf8proc_ssize_t n = utf8proc_decompose_char(cp, buf, 32, opts, nullptr);
+                if (n <= 0 || n > 32) continue;
+                if (utf8proc_normalize_utf32(buf, n, opts) == 1 && buf[0] == cp) t.push_back(cp);
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    // Normalizes [p, p + len) into out through a per-thread code point buffer.
+    void normalize_span(const uint8_t* p, size_t len, std::string& out) const {
+        static thread_local std::vector<utf8proc_int32_t> buf(64);
+        utf8proc_ssize_t n = utf8proc_decompose(p, (utf8proc_ssize_t)len, buf.data(), (utf8proc_ssize_t)buf.size(), options());
+        if (n > (utf8proc_ssize_t)buf.size()) {
+            buf.resize((size_t)n);
+            n = utf8proc_decompose(p, (utf8proc_ssize_t)len, buf.data(), n, options());
+        }
+        if (n < 0) { out.append((const char*)p, len); return; }
+        n = utf8proc_normalize_utf32(buf.data(), n, options());
+        for (utf8proc_ssize_t k = 0; k < n; ++k) append_utf8(out, buf[k]);
+    }
+
+public:
+    explicit NFKCNormalizer(bool compose = true) : compose_(compose) {}
+
+    template <class A> bool run(const std::string& text, std::string& out, A align) const {
+        size_t len = std::min(text.size(), strlen(text.c_str()));
+        const uint8_t* p = (const uint8_t*)text.data();
+        size_t copied = 0;      // text[0, copied) is already in out
+        size_t last_stable = 0; // start of a span no earlier code point can affect
+        size_t i = 0;
+        int32_t cp;
+        while (i < len) {
+            if (p[i] < 0x80) { last_stable = i++; continue; }
+            ssize_t r = utf8proc_iterate(p + i, len - i, &cp);
+            if (r <= 0) return false;
+            if (is_stable(cp)) { last_stable = i; i += r; continue; }
+            // Normalize from the last stable code point up to the next one
+            size_t end = i + r;
+            while (end < len) {
+                if (p[end] < 0x80) break;
+                r = utf8proc_iterate(p + end, len - end, &cp);
+                if (r <= 0) return false;
+                if (is_stable(cp)) break;
+                end += r;
+            }
+            if (copied == 0) {
+                // Everything up to end is valid; check the rest before out and align are touched
+                if (!SplitMatcher::valid_utf8(text.data() + end, len - end)) return false;
+                out.clear();
+                align.clear();
+            }
+            out.append(text, copied, last_stable - copied);
+            align.copy(copied, last_stable);
+            size_t before = out.size();
+            normalize_span(p + last_stable, end - last_stable, out);
+            align.map(last_stable, end, out.size() - before);
+            copied = last_stable = i = end;
+        }
+        if (copied == 0) {
+            if (len == text.size()) return false;
+            out.clear();
+            align.clear();
+        }
+        out.append(text, copied, len - copied);
+        align.copy(copied, len);
+        return true;
+    }
+};
+
+class PrependNormalizer : public AlignedNormalizer<PrependNormalizer> {
+    std::string prepend_;
+public:
+    PrependNormalizer(const std::string& p) : prepend_(p) {}
+    // The prefix is aligned to the first character, as in HF.
+    template <class A> bool run(const std::string& text, std::string& out, A align) const {
+        if (prepend_.empty()) return false;
+        out.assign(prepend_);
+        out += text;
+        int32_t cp;
+        ssize_t r = text.empty() ? 0 : utf8proc_iterate((const uint8_t*)text.data(), text.size(), &cp);
+        align.clear();
+        align.map(0, text.empty() ? 0 : (r > 0 ? r : 1), prepend_.size());
+        align.copy(0, text.size());
+        return true;
+    }
+};
+
+// Literal (pattern, content) rules applied left to right without overlaps, as a chain of
+// find/replace passes would. Patterns go into one Aho-Corasick automaton with a dense 256-way
+// transition table, so the text is rewritten in a single pass into one output buffer. A chain
+// is only compiled into one automaton when can_fuse() shows that the passes cannot interact.
+class MultiReplacer {
+public:
+    typedef std::pair<std::string, std::string> Rule;
+
+    explicit MultiReplacer(const std::vector<Rule>& rules) : rules_(rules) {
+        std::vector<int> out(1, -1);
+        next_.assign(256, 0);
+        for (size_t r = 0; r < rules_.size(); ++r) {
+            int state = 0;
+            for (unsigned char c : rules_[r].first) {
+                if (next_[state * 256 + c] == 0) {
+                    next_[state * 256 + c] = (int)out.size();
+                    out.push_back(-1);
+                    next_.resize(out.size() * 256, 0);
+                }
+                state = next_[state * 256 + c];
+            }
+            if (!rules_[r].first.empty() && out[state] == -1) out[state] = (int)r;
+        }
+        // Complete the transitions along failure links, breadth first
+        std::vector<int> fail(out.size(), 0), queue;
+        for (int c = 0; c < 256; ++c) if (next_[c]) queue.push_back(next_[c]);
+        for (size_t q = 0; q < queue.size(); ++q) {
+            int u = queue[q];
+            for (int c = 0; c < 256; ++c) {
+                int v = next_[u * 256 + c];
+                if (v) { fail[v] = next_[fail[u] * 256 + c]; queue.push_back(v); }
+                else next_[u * 256 + c] = next_[fail[u] * 256 + c];
+            }
+        }
+        rule_at_ = out;
+    }
+
+    // True when applying the rules as one pass gives the same text as applying them one after
+    // another: no two patterns can overlap or contain each other, and no content is empty or
+    // shares a byte with a later pattern, so a later pass only matches what the first pass saw.
+    static bool can_fuse(const std::vector<Rule>& rules) {
+        for (size_t i = 0; i < rules.size(); ++i) {
+            const std::string& a = rules[i].first;
+            if (a.empty()) return false;
+            for (size_t j = i + 1; j < rules.size(); ++j) {
+                const std::string& b = rules[j].first;
+                if (rules[i].second.empty() || rules[i].second.find_first_of(b) != std::string::npos) return false;
+                if (a.find(b) != std::string::npos || b.find(a) != std::string::npos) return false;
+                for (size_t k = 1; k < std::min(a.size(), b.size()); ++k) {
+                    if (a.compare(a.size() - k, k, b, 0, k) == 0 || b.compare(b.size() - k, k, a, 0, k) == 0) return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    const std::vector<Rule>& rules() const { return rules_; }
+
+    // Appends the rewritten text to out; returns false (appending nothing) when nothing matched.
+    bool apply(const std::string& text, std::string& out) const { return apply(text, out, NoAlignment()); }
+    template <class A> bool apply(const std::string& text, std::string& out, A align) const {
+        const unsigned char* p = (const unsigned char*)text.data();
+        size_t copied = 0;
+        bool matched = false;
+        int state = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            state = next_[state * 256 + p[i]];
+            int r = rule_at_[state];
+            if (r < 0) continue;
+            const Rule& rule = rules_[r];
+            if (!matched) { out.reserve(out.size() + text.size() + text.size() / 4); matched = true; }
+            size_t start = i + 1 - rule.first.size();
+            out.append(text, copied, start - copied);
+            align.copy(copied, start);
+            out += rule.second;
+            align.map(start, i + 1, rule.second.size());
+            copied = i + 1;
+            state = 0;
+        }
+        if (matched) { out.append(text, copied, std::string::npos); align.copy(copied, text.size()); }
+        return matched;
+    }
+
+private:
+    std::vector<Rule> rules_;
+    std::vector<int> next_;    // state * 256 + byte -> state
+    std::vector<int> rule_at_; // rule whose pattern ends at a state, -1 if none
+};
+
+class ReplaceNormalizer : public AlignedNormalizer<ReplaceNormalizer> {
+    MultiReplacer replacer_;
+public:
+    ReplaceNormalizer(const std::string& p, const std::string& c)
+        : replacer_(std::vector<MultiReplacer::Rule>(p.empty() ? 0 : 1, MultiReplacer::Rule(p, c))) {}
+    explicit ReplaceNormalizer(const std::vector<MultiReplacer::Rule>& rules) : replacer_(rules) {}
+    template <class A> bool run(const std::string& text, std::string& out, A align) const {
+        out.clear();
+        align.clear();
+        return replacer_.apply(text, out, align);
+    }
+    const std::vector<MultiReplacer::Rule>& rules() const { return replacer_.rules(); }
+};
+
+// SentencePiece "Precompiled" normalizer. The base64 charsmap is a little-endian u32 trie size,
+// a darts-clone double array over the source strings, then a pool of NUL-terminated
+// replacements the trie values index into. Follows the HF implementation: whole graphemes
+// shorter than 6 bytes are looked up first, otherwise each code point on its own, and a lookup
+// takes the shortest matching prefix.
+class PrecompiledNormalizer : public AlignedNormalizer<PrecompiledNormalizer> {
+    std::vector<uint32_t> trie_;
+    std::string normalized_;
+    bool ascii_mapped_[128]; // whether a lone ASCII byte has an entry
+
+    static std::string base64_decode(const std::string& in) {
+        static const std::string chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        uint32_t acc = 0;
+        int bits = 0;
+        for (char c : in) {
+            if (c == '=') break;
+            size_t v = chars.find(c);
+            if (v == std::string::npos) continue;
+            acc = (acc << 6) | (uint32_t)v;
+            bits += 6;
+            if (bits >= 8) { bits -= 8; out.push_back((char)((acc >> bits) & 0xFF)); }
+        }
+        return out;
+    }
+
+    // darts-clone unit layout
+    static bool has_leaf(uint32_t u) { return ((u >> 8) & 1) != 0; }
+    static uint32_t unit_value(uint32_t u) { return u & ((1U << 31) - 1); }
+    static uint32_t unit_label(uint32_t u) { return u & ((1U << 31) | 0xFF); }
+    static uint32_t unit_offset(uint32_t u) { return (u >> 10) << ((u & (1U << 9)) >> 6); }
+
+    // Replacement for the shortest prefix of [s, s + len) in the map, or nullptr.
+    const char* transform(const char* s, size_t len) const {
+        size_t pos = unit_offset(trie_[0]);
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = (unsigned char)s[i];
+            if (c == 0) break;
+            pos ^= c;
+            if (pos >= trie_.size()) break;
+            uint32_t unit = trie_[pos];
+            if (unit_label(unit) != c) break;
+            pos ^= unit_offset(unit);
+            if (has_leaf(unit)) {
+                if (pos >= trie_.size()) break;
+                uint32_t v = unit_value(trie_[pos]);
+                return v < normalized_.size() ? normalized_.c_str() + v : nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    // Returns false when the charsmap is missing or malformed.
+    bool load(const std::string& charsmap) {
+        std::string blob = base64_decode(charsmap);
+        if (blob.size() < 4) return false;
+        const unsigned char* b = (const unsigned char*)blob.data();
+        uint32_t trie_size = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+        if (trie_size == 0 || trie_size % 4 != 0 || trie_size > blob.size() - 4) return false;
+        trie_.resize(trie_size / 4);
+        for (size_t i = 0; i < trie_.size(); ++i) {
+            const unsigned char* u = b + 4 + i * 4;
+            trie_[i] = u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+        }
+        normalized_ = blob.substr(4 + trie_size);
+        for (int c = 0; c < 128; ++c) {
+            char ch = (char)c;
+            ascii_mapped_[c] = transform(&ch, 1) != nullptr;
+        }
+        return true;
+    }
+
+    template <class A> bool run(const std::string& text, std::string& out, A align) const {
+        out.clear();
+        align.clear();
+        const char* p = text.data();
+        size_t len = text.size();
+        auto char_len = [&](size_t i) -> size_t {
+            int32_t cp;
+            ssize_t r = utf8proc_iterate((const uint8_t*)p + i, len - i, &cp);
+            return r > 0 ? (size_t)r : 1;
+        };
+        size_t i = 0;
+        while (i < len) {
+            // Unmapped ASCII followed by ASCII is a grapheme of its own ("\r\n" aside): copy the run
+            size_t run = i;
+            while (run + 1 < len && (unsigned char)p[run] < 0x80 && (unsigned char)p[run + 1] < 0x80 &&
+                   !ascii_mapped_[(unsigned char)p[run]] && p[run] != '\r') ++run;
+            if (run > i) { out.append(p + i, run - i); align.copy(i, run); i = run; }
+
+            // Extent of the grapheme cluster starting at i
+            size_t end = i + char_len(i);
+            int32_t prev_cp, cp;
+            utf8proc_iterate((const uint8_t*)p + i, len - i, &prev_cp);
+            utf8proc_int32_t state = 0;
+            while (end < len) {
+                ssize_t r = utf8proc_iterate((const uint8_t*)p + end, len - end, &cp);
+                if (r <= 0 || prev_cp < 0 || utf8proc_grapheme_break_stateful(prev_cp, cp, &state)) break;
+                prev_cp = cp;
+                end += r;
+            }
+            const char* norm = end - i < 6 ? transform(p + i, end - i) : nullptr;
+            if (norm) {
+                size_t n = strlen(norm);
+                out.append(norm, n);
+                align.map(i, end, n);
+            } else {
+                for (size_t c = i; c < end;) {
+                    size_t n = char_len(c);
+                    const char* part = transform(p + c, n);
+                    if (part) { size_t m = strlen(part); out.append(part, m); align.map(c, c + n, m); }
+                    else { out.append(p + c, n); align.copy(c, c + n); }
+                    c += n;
+                }
+            }
+            i = end;
+        }
+        return true;
+    }
+};
+
+class SequenceNormalizer : public Normalizer {
+    std::vector<std::shared_ptr<Normalizer>> normalizers_;
+public:
+    SequenceNormalizer(const std::vector<std::shared_ptr<Normalizer>>& n) : normalizers_(n) {}
+    // Stages ping-pong between out and a scratch string borrowed from a per-thread free list
+    // (nested sequences borrow their own), so no stage copies or allocates in steady state.
+    bool normalize_into(const std::string& text, std::string& out) const override {
+        static thread_local std::vector<std::string> spare;
+        std::string scratch;
+        if (!spare.empty()) { scratch.swap(spare.back()); spare.pop_back(); }
+        const std::string* cur = &text;
+        for (const auto& n : normalizers_) {
+            std::string* dst = (cur == &out) ? &scratch : &out;
+            if (n->normalize_into(*cur, *dst)) cur = dst;
+        }
+        if (cur == &scratch) out.swap(scratch);
+        spare.push_back(std::move(scratch));
+        return cur != &text;
+    }
+    // Each stage's alignment is composed with the one so far, so align refers to text.
+    bool normalize_aligned(const std::string& text, std::string& out, std::vector<Offset>& align) const override {
+        std::string step;
+        std::vector<Offset> step_align;
+        bool changed = false;
+        for (const auto& n : normalizers_) {
+            if (!n->normalize_aligned(changed ? out : text, step, step_align)) continue;
+            if (changed) {
+                for (auto& r : step_align) r = span_of(align, r.first, r.second);
+            }
+            out.swap(step);
+            align.swap(step_align);
+            changed = true;
+        }
+        return changed;
+    }
+};
+
+class BertNormalizer : public AlignedNormalizer<BertNormalizer> {
+    bool clean_text_, handle_chinese_chars_, strip_accents_, lowercase_;
+
+    // What every BMP code point normalizes to, for one combination of options. block_of[cp >> 8]
+    // selects a deduplicated block of 256 entries; an entry is one of the k* markers below or
+    // (length << 24 | offset) of the UTF-8 output in pool. Code points past the BMP are rare
+    // enough to go through map_codepoint directly.
+    struct Table { std::vector<uint16_t> block_of; std::vector<uint32_t> entries; std::string pool; };
+    enum : uint32_t { kKeep = 0xFFFFFFFF, kDrop = 0xFFFFFFFE, kPad = 0xFFFFFFFD };
+    std::shared_ptr<const Table> table_;
+
+    // Tables are built once per process for each combination of options.
+    static std::shared_ptr<const Table> shared_table(const BertNormalizer& n) {
+        static std::mutex mu;
+        static std::shared_ptr<const Table> tables[16];
+        int key = n.clean_text_ | n.handle_chinese_chars_ << 1 | n.strip_accents_ << 2 | n.lowercase_ << 3;
+        std::lock_guard<std::mutex> lock(mu);
+        if (!tables[key]) tables[key] = build_table(n);
+        return tables[key];
+    }
+
+    static std::shared_ptr<const Table> build_table(const BertNormalizer& n) {
+        auto t = std::make_shared<Table>();
+        std::map<std::vector<uint32_t>, uint16_t> blocks;
+        std::unordered_map<std::string, uint32_t> offsets;
+        std::vector<uint32_t> block(256);
+        std::string mapped;
+        for (int32_t hi = 0; hi < 0x100; ++hi) {
+            for (int32_t lo = 0; lo < 256; ++lo) {
+                int32_t cp = hi << 8 | lo;
+                mapped.clear();
+                n.map_codepoint(cp, [&](int32_t c) { append_utf8(mapped, c); });
+                std::string self = utf8_of(cp);
+                uint32_t e;
+                if (mapped.empty()) e = kDrop;
+                else if (mapped == self) e = kKeep;
+                else if (mapped == " " + self + " ") e = kPad;
+                else {
+                    auto it = offsets.find(mapped);
+                    if (it == offsets.end()) {
+                        it = offsets.emplace(mapped, (uint32_t)t->pool.size()).first;
+                        t->pool += mapped;
+                    }
+                    e = (uint32_t)mapped.size() << 24 | it->second;
+                }
+                block[lo] = e;
+            }
+            auto it = blocks.find(block);
+            if (it == blocks.end()) {
+                it = blocks.emplace(block, (uint16_t)(t->entries.size() / 256)).first;
+                t->entries.insert(t->entries.end(), block.begin(), block.end());
+            }
+            t->block_of.push_back(it->second);
+        }
+        return t;
+    }
+
+    static std::string utf8_of(int32_t cp) { std::string s; append_utf8(s, cp); return s; }
+
+public:
+    BertNormalizer(bool clean = true, bool chinese = true, bool accents = false, bool lower = true)
+        : clean_text_(clean), handle_chinese_chars_(chinese), strip_accents_(accents), lowercase_(lower) {
+        table_ = shared_table(*this);
+    }
+
+    template <class A> bool run(const std::string& text, std::string& out, A align) const {
+        const Table& t = *table_;
+        const uint8_t* ptr = (const uint8_t*)text.c_str();
+        size_t len = text.length(), i = 0;
+        size_t copied = 0; // text[0, copied) is accounted for in out; kept code points are copied lazily
+        bool changed = false;
+        auto flush = [&](size_t upto) {
+            if (!changed) { out.clear(); align.clear(); changed = true; }
+            out.append(text, copied, upto - copied);
+            align.copy(copied, upto);
+        };
+        int32_t cp;
+        while (i < len) {
+            // Runs of ASCII the table keeps need no work
+            while (i < len && ptr[i] < 0x80 && t.entries[t.block_of[0] * 256 + ptr[i]] == kKeep) ++i;
+            if (i == len) break;
+
+            ssize_t r = utf8proc_iterate(ptr + i, len - i, &cp);
+            if (r <= 0) { flush(i); copied = ++i; continue; }
+            if (cp >= 0x10000) {
+                std::string mapped;
+                map_codepoint(cp, [&](int32_t c) { append_utf8(mapped, c); });
+                if (mapped.compare(0, std::string::npos, text, i, r) != 0) {
+                    flush(i);
+                    out += mapped;
+                    align.map(i, i + r, mapped.size());
+                    copied = i + r;
+                }
+            } else {
+                uint32_t e = t.entries[t.block_of[cp >> 8] * 256 + (cp & 0xFF)];
+                if (e != kKeep) {
+                    flush(i);
+                    if (e == kPad) { out += ' '; out.append((const char*)ptr + i, r); out += ' '; align.map(i, i + r, r + 2); }
+                    else if (e != kDrop) { out.append(t.pool, e & 0xFFFFFF, e >> 24); align.map(i, i + r, e >> 24); }
+                    copied = i + r;
+                }
+            }
+            i += r;
+        }
+        if (changed) { out.append(text, copied, std::string::npos); align.copy(copied, text.size()); }
+        return changed;
+    }
+
+    // Calls emit(c) for each code point that cp normalizes to, in order.
+    template <typename F>
+    void map_codepoint(int32_t cp, F emit) const {
+        // Clean text: remove control chars, replace whitespace
+        if (clean_text_) {
+            if (cp == '\t' || cp == '\n' || cp == '\r' || utf8proc_category(cp) == UTF8PROC_CATEGORY_ZS) { emit(' '); return; }
+            if (cp == 0 || cp == 0xFFFD || utf8proc_category(cp) == UTF8PROC_CATEGORY_CC) return;
+        }
+
+        // Handle Chinese chars: pad with spaces
+        if (handle_chinese_chars_ && is_chinese_char(cp)) {
+            emit(' '); emit(lower(cp)); emit(' ');
+            return;
+        }
+
+        // Strip accents: decompose and skip combining marks
+        if (strip_accents_) {
+            utf8proc_int32_t decomposed[32];
+            int boundclass = UTF8PROC_BOUNDCLASS_START;
+            utf8proc_ssize_t n = utf8proc_decompose_char(cp, decomposed, 32, UTF8PROC_DECOMPOSE, &boundclass);
+            if (n > 0 && n <= 32) {
+                for (utf8proc_ssize_t k = 0; k < n && decomposed[k] != 0; ++k) {
+                    if (utf8proc_category(decomposed[k]) != UTF8PROC_CATEGORY_MN) emit(lower(decomposed[k]));
+                }
+                return;
+            }
+        }
+
+        emit(lower(cp));
+    }
+
+private:
+    int32_t lower(int32_t cp) const { return lowercase_ ? utf8proc_tolower(cp) : cp; }
+
+    static bool is_chinese_char(int32_t cp) {
+        return (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+               (cp >= 0x20000 && cp <= 0x2A6DF) || (cp >= 0x2A700 && cp <= 0x2B73F) ||
+               (cp >= 0x2B740 && cp <= 0x2B81F) || (cp >= 0x2B820 && cp <= 0x2CEAF) ||
+               (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0x2F800 && cp <= 0x2FA1F);
+    }
+};
+
+class SequencePreTokenizer : public PreTokenizer {
+public:
+    std::vector<std::shared_ptr<PreTokenizer>> pts_;
+    SequencePreTokenizer(const std::vector<std::shared_ptr<PreTokenizer>>& pts) : pts_(pts) {}
+    void pre_tokenize(PreTokenizedString& pts) const override {
+        for (const auto& pt : pts_) pt->pre_tokenize(pts);
+    }
+    void pre_tokenize_stream(const char* text, size_t len, const SplitSink& sink) const override {
+        Stage{*this, 0, sink}(text, len);
+    }
+
+private:
+    // Runs a piece through pts_[k] and on, each stage living on the stack of the one before it.
+    struct Stage {
+        const SequencePreTokenizer& seq;
+        size_t k;
+        const SplitSink& sink;
+        void operator()(const char* s, size_t n) const {
+            if (k == seq.pts_.size()) { sink(s, n); return; }
+            Stage next{seq, k + 1, sink};
+            seq.pts_[k]->pre_tokenize_stream(s, n, next);
+        }
+    };
+};
+
+class ByteLevelPreTokenizer : public PreTokenizer {
+    bool use_regex_ = false;
+    bool emit_raw_bytes_ = false;
+    mutable std::shared_ptr<OnigRegex> regex_;
+    std::shared_ptr<const SplitMatcher> matcher_;
+
+    bool cuts() const { return use_regex_ && regex_ && regex_->is_valid(); }
+    static const std::vector<std::string>& byte_map() {
+        static auto map = create_bytes_char_map();
+        return map;
+    }
+public:
+    ByteLevelPreTokenizer(bool use_regex = false) : use_regex_(use_regex) {
+        if (use_regex_) {
+            const char* pattern = "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+";
+            regex_ = std::make_shared<OnigRegex>(pattern);
+            matcher_ = SplitMatcher::find(pattern);
+        }
+    }
+    template <class B> void cut(const char* s, size_t len, size_t i, B& next) const {
+        int last_pos = 0;
+        for_each_match(*regex_, matcher_.get(), s, len, [&](int match_start, int match_end) {
+            if (match_start > last_pos) next.add(i, last_pos, match_start - last_pos);
+            if (match_end > match_start) next.add(i, match_start, match_end - match_start);
+            last_pos = match_end > match_start ? match_end : match_end + 1;
+        });
+        if (last_pos < (int)len) next.add(i, last_pos, len - last_pos);
+    }
+    void pre_tokenize(PreTokenizedString& pts) const override {
+        if (cuts()) {
+            SplitBuilder next(pts);
+            for (size_t i = 0; i < pts.splits.size(); ++i) cut(pts.data(i), pts.size(i), i, next);
+            next.finish();
+        }
+        if (emit_raw_bytes_) return;
+        const std::vector<std::string>& map = byte_map();
+        std::string& out = pts.scratch;
+        out.clear();
+        pts.scratch_align.clear();
+        for (Span& split : pts.splits) {
+            size_t start = out.size();
+            for (size_t k = split.offset; k < split.offset + split.length; ++k) {
+                const std::string& mapped = map[(unsigned char)pts.buffer[k]];
+                out += mapped;
+                if (pts.track) pts.scratch_align.insert(pts.scratch_align.end(), mapped.size(), pts.align[k]);
+            }
+            split = Span{start, out.size() - start};
+        }
+        pts.buffer.swap(out);
+        pts.align.swap(pts.scratch_align);
+    }
+    void pre_tokenize_stream(const char* text, size_t len, const SplitSink& sink) const override {
+        if (emit_raw_bytes_) { cut_stream(text, len, sink); return; }
+        const std::vector<std::string>& map = byte_map();
+        StreamBuffer buffer;
+        std::string& mapped = buffer.get();
+        cut_stream(text, len, [&](const char* s, size_t n) {
+            mapped.clear();
+            for (size_t k = 0; k < n; ++k) mapped += map[(unsigned char)s[k]];
+            sink(mapped.data(), mapped.size());
+        });
+    }
+    void cut_stream(const char* text, size_t len, const SplitSink& sink) const {
+        if (!cuts()) { sink(text, len); return; }
+        SplitStreamer next(text, sink);
+        cut(text, len, 0, next);
+        next.finish();
+    }
+    // Leave splits as raw bytes; the model maps bytes to ids itself (see BPEModel::enable_raw_bytes).
+    void set_emit_raw_bytes(bool raw) { emit_raw_bytes_ = raw; }
+};
+
+class DigitsPreTokenizer : public CuttingPreTokenizer<DigitsPreTokenizer> {
+    bool individual_digits_;
+public:
+    DigitsPreTokenizer(bool id) : individual_digits_(id) {}
+    template <class B> void cut(const char* s, size_t size, size_t k, B& next) const {
+        for (size_t i = 0; i < size; ) {
+            int32_t cp;
+            int len = utf8proc_iterate((const uint8_t*)s + i, size - i, &cp);
+            if (len <= 0) break;
+            bool is_digit = (len == 1 && s[i] >= '0' && s[i] <= '9');
+            if (is_digit && individual_digits_) next.add(k, i, len);
+            else next.append(k, i, len);
+            i += len;
+        }
+        next.push();
+    }
+};
+
+class MetaspacePreTokenizer : public PreTokenizer {
+public:
+    std::string replacement_;
+    bool add_prefix_space_;
+    MetaspacePreTokenizer(const std::string& rep, bool aps) : replacement_(rep), add_prefix_space_(aps) {}
+    // Appends the rewritten piece to out and, when align is given, the input span of each byte.
+    void rewrite(const uint8_t* s, size_t size, std::string& out, const Offset* a, std::vector<Offset>* align) const {
+        if (add_prefix_space_ && size > 0 && s[0] != ' ') {
+            out += replacement_;
+            // The added space is aligned to the first character
+            if (align) {
+                int32_t cp;
+                ssize_t r = utf8proc_iterate(s, size, &cp);
+                align->insert(align->end(), replacement_.size(), span_of(a, size, 0, r > 0 ? r : 1));
+            }
+        }
+        for (size_t i = 0; i < size;) {
+            int32_t cp;
+            int len = utf8proc_iterate(s + i, size - i, &cp);
+            if (len <= 0) break;
+            bool space = len == 1 && s[i] == ' ';
+            if (space) out += replacement_; else out.append((const char*)s + i, len);
+            if (align) {
+                if (space) align->insert(align->end(), replacement_.size(), a[i]);
+                else align->insert(align->end(), a + i, a + i + len);
+            }
+            i += len;
+        }
+    }
+    void pre_tokenize(PreTokenizedString& pts) const override {
+        std::string& out = pts.scratch;
+        out.clear();
+        pts.scratch_align.clear();
+        for (Span& split : pts.splits) {
+            size_t start = out.size();
+            rewrite((const uint8_t*)pts.buffer.data() + split.offset, split.length, out,
+                    pts.align.data() + (pts.track ? split.offset : 0), pts.track ? &pts.scratch_align : nullptr);
+            split = Span{start, out.size() - start};
+        }
+        pts.buffer.swap(out);
+        pts.align.swap(pts.scratch_align);
+    }
+    void pre_tokenize_stream(const char* text, size_t len, const SplitSink& sink) const override {
+        StreamBuffer buffer;
+        std::string& out = buffer.get();
+        rewrite((const uint8_t*)text, len, out, nullptr, nullptr);
+        sink(out.data(), out.size());
+    }
+};
+
+class SplitPreTokenizer : public CuttingPreTokenizer<SplitPreTokenizer> {
+public:
+    std::unique_ptr<OnigRegex> regex_;
+    std::shared_ptr<const SplitMatcher> matcher_; // Oniguruma-free equivalent of the pattern, if any
+    bool invert_;
+    std::string behavior_;
+    SplitPreTokenizer(const std::string& pattern, bool invert, const std::string& behavior = "Isolated")
+        : regex_(tokenizer_make_unique<OnigRegex>(pattern)), matcher_(SplitMatcher::find(pattern)), invert_(invert), behavior_(behavior) {}
+    template <class B> void cut(const char* s, size_t len, size_t i, B& next) const {
+        int current_pos = 0;
+        for_each_match(*regex_, matcher_.get(), s, len, [&](int match_start, int match_end) {
+            if (invert_) {
+                // Invert means we keep the matched parts
+                if (match_end > match_start) next.add(i, match_start, match_end - match_start);
+            } else {
+                // Not inverted means we split by the matched parts
+                if (match_start > current_pos) next.add(i, current_pos, match_start - current_pos);
+                if (behavior_ == "Isolated" && match_end > match_start) next.add(i, match_start, match_end - match_start);
+                // If behavior_ == "Removed", we just don't add the matched part
+            }
+            current_pos = match_end;
+            if (match_start == match_end) { // Handle zero-width matches to avoid infinite loops
+                current_pos++;
+            }
+        });
+        // No more matches, add the rest of the string
+        if (current_pos < (int)len) next.add(i, current_pos, len - current_pos);
+    }
+    void pre_tokenize(PreTokenizedString& pts) const override {
+        if (!regex_ || !regex_->is_valid()) return;
+        CuttingPreTokenizer::pre_tokenize(pts);
+    }
+    void pre_tokenize_stream(const char* text, size_t len, const SplitSink& sink) const override {
+        if (!regex_ || !regex_->is_valid()) { sink(text, len); return; }
+        CuttingPreTokenizer::pre_tokenize_stream(text, len, sink);
+    }
+};
+
+class BertPreTokenizer : public CuttingPreTokenizer<BertPreTokenizer> {
+public:
+    template <class B> void cut(const char* s, size_t len, size_t k, B& next) const {
+        const uint8_t* ptr = (const uint8_t*)s;
+        size_t i = 0;
+        int32_t cp;
+        while (i < len) {
+            ssize_t r = utf8proc_iterate(ptr + i, len - i, &cp);
+            if (r <= 0) { i++; continue; }
+            if (is_whitespace(cp)) next.push();
+            else if (is_punctuation(cp)) next.add(k, i, r);
+            else next.append(k, i, r);
+            i += r;
+        }
+        next.push();
+    }
+
+    static bool is_whitespace(int32_t cp) {
+        return cp == ' ' || cp == '\t' || cp == '\n' || cp == '\r' || utf8proc_category(cp) == UTF8PROC_CATEGORY_ZS;
+    }
+
+    static bool is_punctuation(int32_t cp) {
+        if ((cp >= 33 && cp <= 47) || (cp >= 58 && cp <= 64) || (cp >= 91 && cp <= 96) || (cp >= 123 && cp <= 126)) return true;
+        utf8proc_category_t cat = utf8proc_category(cp);
+        return cat == UTF8PROC_CATEGORY_PD || cat == UTF8PROC_CATEGORY_PS || cat == UTF8PROC_CATEGORY_PE ||
+               cat == UTF8PROC_CATEGORY_PC || cat == UTF8PROC_CATEGORY_PO || cat == UTF8PROC_CATEGORY_PI ||
+               cat == UTF8PROC_CATEGORY_PF;
+    }
+};
+
+// Moved create_bytes_char_map up
+
+// Double-array trie over byte strings. A node is an index into the arrays (the root is 0) and
+// its child on byte c sits at base[node] + c, owned by the node when check[] points back at it.
+// Walking one byte is two array reads, so prefix searches never build a string or hash one.
+class DoubleArrayTrie {
+public:
+    // Values must be >= 0; later duplicates of a key overwrite earlier values.
+    void build(const std::vector<std::pair<std::string, int>>& keys) {
+        struct Node { std::vector<std::pair<unsigned char, int>> children; int value = -1; };
+        std::vector<Node> nodes(1);
+        for (const auto& k : keys) {
+            int n = 0;
+            for (unsigned char c : k.first) {
+                auto& ch = nodes[n].children;
+                auto it = std::lower_bound(ch.begin(), ch.end(), std::make_pair(c, 0));
+                if (it == ch.end() || it->first != c) {
+                    it = ch.insert(it, std::make_pair(c, (int)nodes.size()));
+                    nodes.emplace_back();
+                }
+                n = it->second;
+            }
+            nodes[n].value = k.second;
+        }
+
+        // Free slots form a doubly linked list in index order, so placing a node only visits
+        // holes instead of rescanning the occupied prefix of the arrays.
+        std::vector<int> next_free, prev_free;
+        int head = -1, tail = -1;
+        base_.clear(); check_.clear(); value_.clear();
+        auto grow = [&](size_t size) {
+            size_t old = check_.size();
+            if (size <= old) return;
+            size = std::max(size, old + old / 2 + 256);
+            base_.resize(size, 0); check_.resize(size, kFree); value_.resize(size, -1);
+            next_free.resize(size, -1); prev_free.resize(size, -1);
+            for (size_t i = std::max<size_t>(old, 1); i < size; ++i) {
+                prev_free[i] = tail; next_free[i] = -1;
+                if (tail != -1) next_free[tail] = (int)i; else head = (int)i;
+                tail = (int)i;
+            }
+        };
+        grow(256);
+        check_[0] = kRoot;
+
+        std::vector<std::pair<int, int>> queue(1, std::make_pair(0, 0)); // (builder node, slot)
+        for (size_t q = 0; q < queue.size(); ++q) {
+            const Node& node = nodes[queue[q].first];
+            int slot = queue[q].second;
+            value_[slot] = node.value;
+            if (node.children.empty()) continue;
+            int first = node.children.front().first, last = node.children.back().first;
+            int base = 0;
+            for (int p = head;; p = next_free[p]) {
+                if (p == -1) { p = (int)check_.size(); grow(check_.size() + 256); }
+                base = p - first;
+                grow((size_t)(base + last + 1));
+                bool fits = true;
+                for (const auto& ch : node.children) {
+                    if (check_[base + ch.first] != kFree) { fits = false; break; }
+                }
+                if (fits) break;
+            }
+            base_[slot] = base;
+            for (const auto& ch : node.children) {
+                int t = base + ch.first;
+                check_[t] = slot;
+                if (prev_free[t] != -1) next_free[prev_free[t]] = next_free[t]; else head = next_free[t];
+                if (next_free[t] != -1) prev_free[next_free[t]] = prev_free[t]; else tail = prev_free[t];
+                queue.push_back(std::make_pair(ch.second, t));
+            }
+        }
+        size_t used = check_.size();
+        while (used > 1 && check_[used - 1] == kFree) --used;
+        base_.resize(used); check_.resize(used); value_.resize(used);
+        base_.shrink_to_fit(); check_.shrink_to_fit(); value_.shrink_to_fit();
+    }
+
+    // Moves `node` to its child on byte c; returns false (leaving node alone) when there is none.
+    bool next(int& node, unsigned char c) const {
+        size_t t = (size_t)(base_[node] + c);
+        if (t >= check_.size() || check_[t] != node) return false;
+        node = (int)t;
+        return true;
+    }
+
+    // Value of the key ending at `node`, -1 if no key ends there.
+    int value(int node) const { return value_[node]; }
+
+    int find(const char* s, size_t len) const {
+        int node = 0;
+        for (size_t i = 0; i < len; ++i) {
+            if (!next(node, (unsigned char)s[i])) return -1;
+        }
+        return value_[node];
+    }
+
+    // Calls f(byte, child) for each child of `node`, in byte order.
+    template <typename F>
+    void for_each_child(int node, F f) const {
+        for (int c = 0; c < 256; ++c) {
+            size_t t = (size_t)(base_[node] + c);
+            if (t < check_.size() && check_[t] == node) f((unsigned char)c, (int)t);
+        }
+    }
+
+    // Upper bound (exclusive) on node indices, for per-node side tables.
+    size_t size() const { return check_.size(); }
+    bool empty() const { return check_.empty(); }
+    size_t memory_usage() const { return check_.capacity() * 3 * sizeof(int); }
+
+private:
+    enum { kFree = -1, kRoot = -2 }; // check[] of unused slots and of the root
+
+    std::vector<int> base_, check_, value_;
+};
+
+// Open-addressing hash table from a packed (left, right) id pair to the merge rank and the
+// id of the merged token. Slots live in one contiguous array, so a lookup is a single probe
+// sequence with no string building.
+class MergeTable {
+public:
+    struct Entry { uint64_t key; int rank; int merged; };
+
+    void build(const std::vector<std::pair<uint64_t, std::pair<int, int>>>& items) {
+        size_t cap = 16;
+        while (cap < items.size() * 2) cap <<= 1;
+        slots_.assign(cap, Entry{kEmpty, 0, -1});
+        mask_ = cap - 1;
+        size_ = 0;
+        for (const auto& it : items) insert(it.first, it.second.first, it.second.second);
+    }
+
+    const Entry* find(int left, int right) const {
+        if (slots_.empty()) return nullptr;
+        uint64_t key = pack(left, right);
+        for (size_t i = hash(key) & mask_;; i = (i + 1) & mask_) {
+            const Entry& e = slots_[i];
+            if (e.key == key) return &e;
+            if (e.key == kEmpty) return nullptr;
+        }
+    }
+
+    size_t size() const { return size_; }
+    size_t memory_usage() const { return slots_.capacity() * sizeof(Entry); }
+
+    // Calls f(left, right, entry) for every merge, in slot order.
+    template <class F> void for_each(F f) const {
+        for (const Entry& e : slots_) {
+            if (e.key != kEmpty) f((int)(uint32_t)(e.key >> 32), (int)(uint32_t)e.key, e);
+        }
+    }
+
+    static uint64_t pack(int left, int right) { return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right; }
+
+private:
+    static const uint64_t kEmpty = ~(uint64_t)0;
+
+    static size_t hash(uint64_t key) {
+        key ^= key >> 33; key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33; key *= 0xc4ceb9fe1a85ec53ULL;
+        return (size_t)(key ^ (key >> 33));
+    }
+
+    void insert(uint64_t key, int rank, int merged) {
+        if (key == kEmpty) return;
+        for (size_t i = hash(key) & mask_;; i = (i + 1) & mask_) {
+            Entry& e = slots_[i];
+            if (e.key == kEmpty) { e.key = key; ++size_; }
+            if (e.key == key) { e.rank = rank; e.merged = merged; return; }
+        }
+    }
+
+    std::vector<Entry> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+};
+
+// Thread-safe cache from a pre-token to its ids. Keys are hashed onto independent shards, each
+// with its own mutex that every lookup takes, so concurrent encodes wait only when they hit the
+// same shard. Shards evict by CLOCK: a hit only sets the entry's reference bit, so the critical
+// section of a lookup is the hash probe and the copy. The entry and byte budgets are split evenly
+// across the active shards; small budgets use fewer shards so that each one still holds a useful
+// number of words.
+class WordCache {
+public:
+    static const size_t kDefaultMaxEntries = 65536;
+    static const size_t kDefaultMaxBytes = 64 << 20;
+    static const size_t kShards = 64;
+    static const size_t kMinEntriesPerShard = 256;
+
+    WordCache(size_t max_entries = kDefaultMaxEntries, size_t max_bytes = kDefaultMaxBytes) : active_(1) {
+        set_capacity(max_entries, max_bytes);
+    }
+
+    // Appends the cached ids of key to ids.
+    bool get(const std::string& key, std::vector<int>& ids) {
+        return with_shard(key, [&](Shard& s) { return s.get(key, ids); });
+    }
+    void put(const std::string& key, const std::vector<int>& ids) {
+        with_shard(key, [&](Shard& s) { s.put(key, ids); return true; });
+    }
+
+    // Safe while other threads encode: the shard count only changes with every shard locked.
+    void set_capacity(size_t max_entries, size_t max_bytes) {
+        size_t n = std::max<size_t>(1, std::min(kShards, max_entries / kMinEntriesPerShard));
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (auto& s : shards_) locks.emplace_back(s.mutex);
+        if (n != active_.load()) {
+            active_.store(n);
+            for (auto& s : shards_) s.clear(); // keys now hash to different shards
+        }
+        for (size_t i = 0; i < kShards; ++i) {
+            if (i < n) shards_[i].set_capacity((max_entries + n - 1) / n, (max_bytes + n - 1) / n);
+            else shards_[i].set_capacity(0, 0);
+        }
+    }
+
+    CacheStats stats() const {
+        CacheStats total;
+        for (const auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            CacheStats st = s.stats();
+            total.hits += st.hits; total.misses += st.misses; total.evictions += st.evictions;
+            total.entries += st.entries; total.bytes += st.bytes;
+        }
+        return total;
+    }
+
+    void clear() {
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.clear();
+        }
+    }
+
+private:
+    // The members of a shard are guarded by its mutex, which callers hold.
+    class Shard {
+    public:
+        bool get(const std::string& key, std::vector<int>& ids) {
+            auto it = map_.find(key);
+            if (it == map_.end()) { stats_.misses++; return false; }
+            it->second.referenced = true;
+            ids.insert(ids.end(), it->second.ids.begin(), it->second.ids.end());
+            stats_.hits++;
+            return true;
+        }
+
+        void put(const std::string& key, const std::vector<int>& ids) {
+            size_t cost = entry_bytes(key, ids);
+            if (max_entries_ == 0 || (max_bytes_ && cost > max_bytes_)) return;
+            auto it = map_.find(key);
+            if (it != map_.end()) {
+                stats_.bytes -= entry_bytes(key, it->second.ids);
+                it->second.ids = ids;
+            } else {
+                it = map_.emplace(key, Entry()).first;
+                it->second.ids = ids;
+                clock_.push_back(&*it);
+            }
+            // New entries start referenced so the hand passes them once before they can go
+            it->second.referenced = true;
+            stats_.bytes += cost;
+            evict();
+        }
+
+        void set_capacity(size_t max_entries, size_t max_bytes) {
+            max_entries_ = max_entries;
+            max_bytes_ = max_bytes;
+            evict();
+        }
+
+        CacheStats stats() const {
+            CacheStats s = stats_;
+            s.entries = map_.size();
+            return s;
+        }
+
+        void clear() {
+            map_.clear();
+            clock_.clear();
+            hand_ = 0;
+            stats_.bytes = 0;
+        }
+
+        mutable std::mutex mutex;
+
+    private:
+        struct Entry { std::vector<int> ids; bool referenced; };
+        typedef std::unordered_map<std::string, Entry> Map;
+
+        // Key and ids plus a rough allowance for the hash node and clock slot.
+        static size_t entry_bytes(const std::string& key, const std::vector<int>& ids) {
+            return key.size() + ids.size() * sizeof(int) + sizeof(Entry) + 3 * sizeof(void*);
+        }
+
+        // Sweeps the hand over the ring, clearing reference bits, and evicts the first entry
+        // found unreferenced; its slot is refilled from the end of the ring.
+        void evict() {
+            while (!clock_.empty() && (map_.size() > max_entries_ || (max_bytes_ && stats_.bytes > max_bytes_))) {
+                if (hand_ >= clock_.size()) hand_ = 0;
+                Map::value_type* victim = clock_[hand_];
+                if (victim->second.referenced) { victim->second.referenced = false; ++hand_; continue; }
+                stats_.bytes -= entry_bytes(victim->first, victim->second.ids);
+                clock_[hand_] = clock_.back();
+                clock_.pop_back();
+                map_.erase(victim->first);
+                stats_.evictions++;
+            }
+        }
+
+        size_t max_entries_ = 0, max_bytes_ = 0;
+        Map map_;
+        std::vector<Map::value_type*> clock_; // entries of map_ in ring order; nodes never move
+        size_t hand_ = 0;
+        CacheStats stats_;
+        char pad_[64]; // keeps neighbouring shard locks off the same cache line
+    };
+
+    // Runs f on key's shard with the shard locked, retrying if the shard count changed meanwhile.
+    template <class F> bool with_shard(const std::string& key, F f) {
+        size_t h = std::hash<std::string>()(key);
+        for (;;) {
+            size_t n = active_.load();
+            Shard& s = shards_[h % n];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (active_.load() == n) return f(s);
+        }
+    }
+
+    Shard shards_[kShards];
+    std::atomic<size_t> active_;
+};
+
+const size_t WordCache::kDefaultMaxEntries;
+const size_t WordCache::kDefaultMaxBytes;
+const size_t WordCache::kShards;
+const size_t WordCache::kMinEntriesPerShard;
+
+// Worker threads shared by all tokenizers, started on first use. run() hands task indices out to
+// the workers and to the calling thread, and returns once every task has finished.
+class ThreadPool {
+public:
+    static ThreadPool& instance() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    void run(size_t tasks, const std::function<void(size_t)>& fn) {
+        if (tasks == 0) return;
+        std::shared_ptr<Job> job = std::make_shared<Job>(&fn, tasks);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(job);
+        }
+        cv_.notify_all();
+        work(*job);
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&]() { return job->done == job->tasks; });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : workers_) t.join();
+    }
+
+private:
+    struct Job {
+        Job(const std::function<void(size_t)>* f, size_t n) : fn(f), tasks(n), next(0) {}
+        const std::function<void(size_t)>* fn;
+        size_t tasks;
+        std::atomic<size_t> next; // next unclaimed task
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    ThreadPool() {
+        unsigned n = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for (unsigned i = 0; i < n; ++i) workers_.emplace_back([this]() { loop(); });
+    }
+
+    static void work(Job& job) {
+        for (size_t i; (i = job.next.fetch_add(1)) < job.tasks; ) {
+            (*job.fn)(i);
+            std::lock_guard<std::mutex> lock(job.mutex);
+            if (++job.done == job.tasks) job.finished.notify_all();
+        }
+    }
+
+    void loop() {
+        for (;;) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+                if (stop_) return;
+                job = jobs_.front();
+                if (job->next.load() >= job->tasks) { jobs_.pop_front(); continue; } // fully claimed
+            }
+            work(*job);
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::shared_ptr<Job>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+
+class BPEModel : public Model {
+public:
+    bool use_byte_level_;
+    std::unordered_map<std::string, int> vocab_;
+    std::unordered_map<int, std::string> id_to_token_;
+    MergeTable merges_;
+    mutable WordCache cache_;
+    int byte_to_id_[256]; // id of each byte's GPT-2 unicode symbol, -1 if missing
+    bool has_all_bytes_ = false;
+    bool ignore_merges_;
+    DoubleArrayTrie raw_vocab_; // byte-level vocabs: raw bytes of each vocab entry -> id
+    std::string raw_pool_;      // raw bytes of id i are raw_pool_[raw_begin_[i], raw_begin_[i + 1])
+    std::vector<uint32_t> raw_begin_;
+    std::vector<int> token_node_; // raw_vocab_ node of each id, -1 if none
+    // Rank-from-vocab mode (see load_vocab_ranks()): merges_ stays empty, the lefts of the splits
+    // of id m are split_left_[split_begin_[m], split_begin_[m + 1]) and a split's rank is its index.
+    bool vocab_ranks_ = false;
+    std::vector<int> split_begin_, split_left_;
+    int parallel_threads_ = 0;  // see set_parallel_encode(); <= 1 keeps every encode serial
+    size_t parallel_min_bytes_ = 0;
+
+    BPEModel(bool use_byte_level, bool ignore_merges) : use_byte_level_(use_byte_level), ignore_merges_(ignore_merges) {}
+
+    BPEModel(const std::map<std::string, int>& vocab,
+             const std::map<std::pair<int, int>, int>& merges,
+             const std::map<std::string, int>& added_tokens,
+             bool use_byte_level,
+             bool byte_fallback,
+             bool ignore_merges = false)
+        : use_byte_level_(use_byte_level), ignore_merges_(ignore_merges) {
+        for (auto const& x : vocab) { vocab_[x.first] = x.second; id_to_token_[x.second] = x.first; }
+        std::vector<std::pair<uint64_t, std::pair<int, int>>> items;
+        items.reserve(merges.size());
+        for (auto const& x : merges) {
+            int merged = token_to_id(id_to_token(x.first.first) + id_to_token(x.first.second));
+            items.push_back({MergeTable::pack(x.first.first, x.first.second), {x.second, merged}});
+        }
+        merges_.build(items);
+        build_byte_table();
+        build_raw_vocab();
+        build_backtracking();
+    }
+
+    // Make tokenize() treat its input as raw bytes looked up in the byte table. Only possible
+    // when the vocab holds all 256 byte symbols, so that no byte is dropped.
+    bool enable_raw_bytes() {
+        if (!has_all_bytes_) return false;
+        use_byte_level_ = true;
+        return true;
+    }
+
+    int token_to_id(const std::string& token) const override {
+        auto it = vocab_.find(token);
+        return (it != vocab_.end()) ? it->second : -1;
+    }
+    std::string id_to_token(int id) const override {
+        auto it = id_to_token_.find(id);
+        return (it != id_to_token_.end()) ? it->second : "";
+    }
+    size_t vocab_size() const override { return vocab_.size(); }
+    size_t memory_usage() const override {
+        size_t n = merges_.memory_usage();
+        n += raw_vocab_.memory_usage() + raw_pool_.capacity() + (raw_begin_.capacity() + token_node_.capacity()) * sizeof(int);
+        n += (split_begin_.capacity() + split_left_.capacity()) * sizeof(int);
+        if (backtrack_) n += backtrack_->rank.capacity() * 5 * sizeof(int);
+        return n;
+    }
+    void set_cache_capacity(size_t max_entries, size_t max_bytes) override { cache_.set_capacity(max_entries, max_bytes); }
+    CacheStats cache_stats() const override { return cache_.stats(); }
+    void clear_cache() override { cache_.clear(); }
+    void set_parallel_encode(int threads, size_t min_bytes) override {
+        parallel_threads_ = threads;
+        parallel_min_bytes_ = std::max<size_t>(min_bytes, 2 * kMinSegment);
+    }
+
+    std::vector<int> tokenize(const std::string& text) const override {
+        std::vector<int> out;
+        tokenize_into(text, out);
+        return out;
+    }
+
+    void tokenize_into(const std::string& text, std::vector<int>& out) const override {
+        if (text.empty()) return;
+        int whole = whole_word_id(text);
+        if (whole != -1) { out.push_back(whole); return; }
+        // Short pre-tokens are merged on the stack, which is cheaper than a cache round trip.
+        if (text.size() <= kSmallWord) {
+            int ids[kSmallWord];
+            int n = 0;
+            initial_symbols(text, [&](int id, size_t, size_t) { ids[n++] = id; });
+            merge_small(ids, n);
+            out.insert(out.end(), ids, ids + n);
+            return;
+        }
+        if (cache_.get(text, out)) return;
+
+        std::vector<int> ids;
+        if (use_byte_level_ && backtrack_ && parallel_threads_ > 1 && text.size() >= parallel_min_bytes_) {
+            encode_parallel(text, ids);
+        } else if (use_byte_level_ && backtrack_) {
+            encode_backtracking(text.data(), text.size(), ids);
+        } else {
+            ids.reserve(text.size());
+            initial_symbols(text, [&](int id, size_t, size_t) { ids.push_back(id); });
+            merge_symbols(ids);
+        }
+        out.insert(out.end(), ids.begin(), ids.end());
+        cache_.put(text, ids);
+    }
+
+    // On raw bytes every id spells its own bytes, so ranges follow from the ids' lengths;
+    // otherwise merge_symbols() reports which initial symbols each id was merged from.
+    void tokenize_with_offsets(const std::string& text, std::vector<int>& out, std::vector<Offset>& offsets) const override {
+        if (text.empty()) return;
+        int whole = whole_word_id(text);
+        if (whole != -1) { out.push_back(whole); offsets.push_back(Offset(0, text.size())); return; }
+        if (use_byte_level_ && has_all_bytes_) {
+            size_t first = out.size(), pos = 0;
+            tokenize_into(text, out);
+            for (size_t k = first; k < out.size(); ++k) {
+                size_t n = raw_begin_[out[k] + 1] - raw_begin_[out[k]];
+                offsets.push_back(Offset(pos, pos + n));
+                pos += n;
+            }
+            return;
+        }
+        std::vector<int> ids, starts;
+        std::vector<Offset> spans;
+        initial_symbols(text, [&](int id, size_t begin, size_t end) { ids.push_back(id); spans.push_back(Offset(begin, end)); });
+        merge_symbols(ids, nullptr, &starts);
+        for (size_t k = 0; k < ids.size(); ++k) {
+            size_t last = k + 1 < ids.size() ? starts[k + 1] - 1 : spans.size() - 1;
+            out.push_back(ids[k]);
+            offsets.push_back(Offset(spans[starts[k]].first, spans[last].second));
+        }
+    }
+
+    void load(const json& v, const json& m) {
+        for (auto it = v.begin(); it != v.end(); ++it) { vocab_[it.key()] = it.value().get<int>(); id_to_token_[it.value().get<int>()] = it.key(); }
+        build_byte_table();
+        build_raw_vocab();
+        if (!load_vocab_ranks(m) && m.is_array()) {
+            std::vector<std::pair<uint64_t, std::pair<int, int>>> items;
+            items.reserve(m.size());
+            int rank = 0;
+            for (const auto& item : m) {
+                std::string s1, s2;
+                split_merge(item, s1, s2);
+                if (!s1.empty() && !s2.empty()) items.push_back({MergeTable::pack(token_to_id(s1), token_to_id(s2)), {rank++, token_to_id(s1 + s2)}});
+            }
+            merges_.build(items);
+        }
+        build_backtracking();
+    }
+
+private:
+    // Halves of a merges entry, written either as "left right" or as ["left", "right"].
+    static void split_merge(const json& item, std::string& s1, std::string& s2) {
+        if (item.is_string()) {
+            std::string line = item.get<std::string>(); size_t p = line.find(' ');
+            if (p != std::string::npos) { s1 = line.substr(0, p); s2 = line.substr(p + 1); }
+        } else if (item.is_array() && item.size() >= 2) { s1 = item[0].get<std::string>(); s2 = item[1].get<std::string>(); }
+    }
+
+    // Rank and merged id of the pair (left, right); false if the pair does not merge.
+    bool find_merge(int left, int right, int& rank, int& merged) const {
+        if (!vocab_ranks_) {
+            const MergeTable::Entry* e = merges_.find(left, right);
+            if (!e) return false;
+            rank = e->rank; merged = e->merged;
+            return true;
+        }
+        if (left < 0 || right < 0 || (size_t)left >= token_node_.size() || (size_t)right >= token_node_.size()) return false;
+        int node = token_node_[left];
+        if (node < 0 || token_node_[right] < 0) return false;
+        for (uint32_t i = raw_begin_[right]; i < raw_begin_[right + 1]; ++i) {
+            if (!raw_vocab_.next(node, (unsigned char)raw_pool_[i])) return false;
+        }
+        int m = raw_vocab_.value(node);
+        if (m < 0) return false;
+        const int* first = split_left_.data() + split_begin_[m];
+        const int* last = split_left_.data() + split_begin_[m + 1];
+        const int* it = std::lower_bound(first, last, left);
+        if (it == last || *it != left) return false;
+        rank = (int)(it - split_left_.data()); merged = m;
+        return true;
+    }
+
+    // Calls f(left, right, rank, merged) for every merge.
+    template <class F> void for_each_merge(F f) const {
+        if (!vocab_ranks_) {
+            merges_.for_each([&](int l, int r, const MergeTable::Entry& e) { f(l, r, e.rank, e.merged); });
+            return;
+        }
+        for (size_t m = 0; m + 1 < split_begin_.size(); ++m) {
+            for (int k = split_begin_[m]; k < split_begin_[m + 1]; ++k) {
+                int l = split_left_[k];
+                uint32_t mid = raw_begin_[m] + (raw_begin_[l + 1] - raw_begin_[l]);
+                int r = raw_vocab_.find(raw_pool_.data() + mid, raw_begin_[m + 1] - mid);
+                f(l, r, k, (int)m);
+            }
+        }
+    }
+
+    bool has_merges() const { return vocab_ranks_ ? !split_left_.empty() : merges_.size() != 0; }
+
+    // Converted tiktoken vocabs (Llama-3, Qwen2, ...) list, for each vocab entry in id order, every
+    // split of it into two vocab entries, ordered by left then right id. When the merges are exactly
+    // that list, ranks follow from the vocab: one pass checks that the (merged, left, right) ids
+    // strictly increase and that the count matches the vocab's splits, then no table is built.
+    bool load_vocab_ranks(const json& m) {
+        if (raw_vocab_.empty() || !m.is_array() || m.size() == 0) return false;
+        int prev[3] = {-1, -1, -1};
+        size_t count = 0;
+        for (const auto& item : m) {
+            std::string s1, s2;
+            split_merge(item, s1, s2);
+            int l = 0, r = 0;
+            if (!walk_symbols(s1, l) || !walk_symbols(s2, r)) return false;
+            int node = l;
+            if (!walk_symbols(s2, node)) return false;
+            int key[3] = {raw_vocab_.value(node), raw_vocab_.value(l), raw_vocab_.value(r)};
+            if (key[0] < 0 || key[1] < 0 || key[2] < 0) return false;
+            if (!std::lexicographical_compare(prev, prev + 3, key, key + 3)) return false;
+            std::copy(key, key + 3, prev);
+            ++count;
+        }
+
+        split_begin_.assign(token_node_.size() + 1, 0);
+        split_left_.clear();
+        for (size_t id = 0; id < token_node_.size(); ++id) {
+            split_begin_[id] = (int)split_left_.size();
+            const char* t = raw_pool_.data() + raw_begin_[id];
+            size_t len = raw_begin_[id + 1] - raw_begin_[id];
+            int node = 0;
+            for (size_t i = 1; i < len && raw_vocab_.next(node, (unsigned char)t[i - 1]); ++i) {
+                int l = raw_vocab_.value(node);
+                if (l >= 0 && raw_vocab_.find(t + i, len - i) >= 0) split_left_.push_back(l);
+            }
+            std::sort(split_left_.begin() + split_begin_[id], split_left_.end());
+        }
+        split_begin_.back() = (int)split_left_.size();
+        if (split_left_.size() != count) {
+            std::vector<int>().swap(split_begin_);
+            std::vector<int>().swap(split_left_);
+            return false;
+        }
+        vocab_ranks_ = true;
+        return true;
+    }
+
+    // Byte spelled by each byte-level symbol, indexed by code point; -1 for other code points.
+    static const std::vector<int>& symbol_bytes() {
+        static std::vector<int> table = []() {
+            std::vector<int> m(0x144, -1);
+            auto byte_vec = create_bytes_char_map();
+            for (int i = 0; i < 256; ++i) {
+                int32_t cp; utf8proc_iterate((const uint8_t*)byte_vec[i].data(), byte_vec[i].size(), &cp);
+                m[cp] = i;
+            }
+            return m;
+        }();
+        return table;
+    }
+
+    // Calls f(byte) for each byte-level symbol of `symbols`; false if it is empty, holds another
+    // character, or f returns false.
+    template <class F> static bool for_each_symbol_byte(const std::string& symbols, F f) {
+        const std::vector<int>& table = symbol_bytes();
+        if (symbols.empty()) return false;
+        for (size_t i = 0; i < symbols.size(); ) {
+            int32_t cp; ssize_t r = utf8proc_iterate((const uint8_t*)symbols.data() + i, symbols.size() - i, &cp);
+            if (r <= 0 || cp < 0 || cp >= (int32_t)table.size() || table[cp] < 0 || !f((unsigned char)table[cp])) return false;
+            i += r;
+        }
+        return true;
+    }
+
+    static bool append_raw_bytes(const std::string& symbols, std::string& out) {
+        return for_each_symbol_byte(symbols, [&](unsigned char b) { out += (char)b; return true; });
+    }
+
+    // Walks raw_vocab_ from `node` along the bytes spelled by byte-level symbols.
+    bool walk_symbols(const std::string& symbols, int& node) const {
+        return for_each_symbol_byte(symbols, [&](unsigned char b) { return raw_vocab_.next(node, b); });
+    }
+
+    // Id of a pre-token that encodes to a single vocab entry, found without merging or touching
+    // the cache: with ignore_merges any entry is taken as is, otherwise only a reachable one.
+    int whole_word_id(const std::string& text) const {
+        if (!use_byte_level_) return ignore_merges_ ? token_to_id(text) : -1;
+        if (raw_vocab_.empty()) return -1;
+        int id = raw_vocab_.find(text.data(), text.size());
+        if (id == -1 || ignore_merges_) return id;
+        return backtrack_ && backtrack_->length[id] > 0 ? id : -1;
+    }
+
+    enum { kSmallWord = 16 }; // longest pre-token (in bytes) handled by merge_small()
+
+    // Calls emit(id, begin, end) for each initial symbol of text and the bytes [begin, end) it
+    // stands for: one per byte on byte-level models, else one per UTF-8 character, falling back
+    // to <0xXX> byte tokens. Never more symbols than bytes.
+    template <class F> void initial_symbols(const std::string& text, F emit) const {
+        if (use_byte_level_) {
+            for (size_t i = 0; i < text.size(); ++i) {
+                int id = byte_to_id_[(unsigned char)text[i]];
+                if (id != -1) emit(id, i, i + 1);
+            }
+            return;
         }
-        pts.splits = next_splits;
-    }
-};
-
-class MetaspacePreTokenizer : public PreTokenizer {
-public:
-    std::string replacement_;
-    bool add_prefix_space_;
-    MetaspacePreTokenizer(const std::string& rep, bool aps) : replacement_(rep), add_prefix_space_(aps) {}
-    void pre_tokenize(PreTokenizedString& pts) const override {
-        for (auto& s : pts.splits) {
-            if (add_prefix_space_ && !s.empty() && s[0] != ' ') {
-                s = " " + s;
+        const uint8_t* ptr = (const uint8_t*)text.c_str();
+        size_t len = text.length(), off = 0;
+        int32_t cp;
+        while (off < len) {
+            ssize_t ret = utf8proc_iterate(ptr + off, len - off, &cp);
+            if (ret <= 0) {
+                char buf[16]; snprintf(buf, sizeof(buf), "<0x%02X>", (unsigned char)ptr[off]);
+                int id = token_to_id(buf); if (id != -1) emit(id, off, off + 1);
+                off++; continue;
             }
-            std::string out;
-            for (size_t i = 0; i < (int)s.size();) {
-                int32_t cp;
-                int len = utf8proc_iterate((const uint8_t*)s.data() + i, s.size() - i, &cp);
-                if (len <= 0) break;
-                std::string c = s.substr(i, len);
-                out += (c == " ") ? replacement_ : c;
-                i += len;
+            std::string s((const char*)ptr + off, ret);
+            int id = token_to_id(s);
+            if (id != -1) emit(id, off, off + ret);
+            else {
+                for (size_t i = 0; i < (size_t)ret; ++i) {
+                    char buf[16]; snprintf(buf, sizeof(buf), "<0x%02X>", (unsigned char)ptr[off+i]);
+                    int bid = token_to_id(buf); if (bid != -1) emit(bid, off + i, off + i + 1);
+                }
             }
-            s = out;
+            off += ret;
         }
     }
-};
 
-class SplitPreTokenizer : public PreTokenizer {
-public:
-    std::unique_ptr<OnigRegex> regex_;
-    bool invert_;
-    std::string behavior_;
-    SplitPreTokenizer(const std::string& pattern, bool invert, const std::string& behavior = "Isolated")
-        : regex_(tokenizer_make_unique<OnigRegex>(pattern)), invert_(invert), behavior_(behavior) {}
-    void pre_tokenize(PreTokenizedString& pts) const override {
-        if (!regex_ || !regex_->is_valid()) return;
-        std::vector<std::string> new_splits;
-        for (const auto& s : pts.splits) {
-            int current_pos = 0;
-            while (current_pos < (int)s.size()) {
-                int match_start = -1, match_end = -1;
-                if (regex_->search(s, current_pos, (int)s.size(), match_start, match_end)) {
-                    // Found a match
-                    if (invert_) {
-                        // Invert means we keep the matched parts
-                        if (match_end > match_start) {
-                            new_splits.push_back(s.substr(match_start, match_end - match_start));
-                        }
-                    } else {
-                        // Not inverted means we split by the matched parts
-                        if (match_start > current_pos) {
-                            new_splits.push_back(s.substr(current_pos, match_start - current_pos));
-                        }
-                        if (behavior_ == "Isolated" && match_end > match_start) {
-                            new_splits.push_back(s.substr(match_start, match_end - match_start));
-                        }
-                        // If behavior_ == "Removed", we just don't add the matched part
-                    }
-                    current_pos = match_end;
-                    if (match_start == match_end) { // Handle zero-width matches to avoid infinite loops
-                        current_pos++;
-                    }
-                } else {
-                    // No more matches, add the rest of the string
-                    if (current_pos < (int)s.size()) {
-                        new_splits.push_back(s.substr(current_pos));
-                    }
-                    break;
-                }
+    // merge_symbols() for at most kSmallWord symbols, in place on fixed-size arrays: at this size a
+    // linear scan for the lowest (then leftmost) rank is faster than a heap and allocates nothing.
+    void merge_small(int* ids, int& n) const {
+        int rank[kSmallWord], merged[kSmallWord];
+        auto lookup = [&](int i) {
+            if (!find_merge(ids[i], ids[i + 1], rank[i], merged[i])) { rank[i] = INT_MAX; merged[i] = -1; }
+        };
+        for (int i = 0; i + 1 < n; ++i) lookup(i);
+        while (n > 1) {
+            int best = -1;
+            for (int i = 0; i + 1 < n; ++i) {
+                if (rank[i] != INT_MAX && (best == -1 || rank[i] < rank[best])) best = i;
             }
+            if (best == -1 || merged[best] == -1) break;
+            ids[best] = merged[best];
+            for (int i = best + 1; i + 1 < n; ++i) { ids[i] = ids[i + 1]; rank[i] = rank[i + 1]; merged[i] = merged[i + 1]; }
+            --n;
+            if (best > 0) lookup(best - 1);
+            if (best + 1 < n) lookup(best);
         }
-        pts.splits = new_splits;
     }
-};
 
-class BertPreTokenizer : public PreTokenizer {
-public:
-    void pre_tokenize(PreTokenizedString& pts) const override {
-        std::vector<std::string> new_splits;
-        for (const auto& s : pts.splits) {
-            std::string current;
-            const uint8_t* ptr = (const uint8_t*)s.c_str();
-            size_t len = s.length(), i = 0;
-            int32_t cp;
-            while (i < len) {
-                ssize_t r = utf8proc_iterate(ptr + i, len - i, &cp);
-                if (r <= 0) { i++; continue; }
-                std::string ch((const char*)ptr + i, r);
-                bool is_whitespace = (cp == ' ' || cp == '\t' || cp == '\n' || cp == '\r' ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_ZS);
-                bool is_punctuation = utf8proc_category(cp) == UTF8PROC_CATEGORY_PD ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_PS ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_PE ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_PC ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_PO ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_PI ||
-                                      utf8proc_category(cp) == UTF8PROC_CATEGORY_PF ||
-                                      (cp >= 33 && cp <= 47) || (cp >= 58 && cp <= 64) ||
-                                      (cp >= 91 && cp <= 96) || (cp >= 123 && cp <= 126);
-                if (is_whitespace) {
-                    if (!current.empty()) { new_splits.push_back(current); current.clear(); }
-                } else if (is_punctuation) {
-                    if (!current.empty()) { new_splits.push_back(current); current.clear(); }
-                    new_splits.push_back(ch);
-                } else {
-                    current += ch;
-                }
-                i += r;
-            }
-            if (!current.empty()) new_splits.push_back(current);
+    void build_byte_table() {
+        static auto byte_map = create_bytes_char_map();
+        has_all_bytes_ = true;
+        for (int b = 0; b < 256; ++b) {
+            byte_to_id_[b] = token_to_id(byte_map[b]);
+            if (byte_to_id_[b] == -1) has_all_bytes_ = false;
         }
-        pts.splits = new_splits;
     }
-};
 
-// Moved create_bytes_char_map up
+    // Symbols form a doubly linked list over the initial positions; a merged symbol keeps
+    // the position of its left half and the right half is unlinked.
+    struct Symbol { int id; int prev; int next; };
+    // Candidate pair starting at `pos`. Candidates are never removed from the heap; stale ones
+    // are detected on pop by comparing the ids they were created with.
+    struct Candidate {
+        int rank, pos, left, right, merged;
+        bool operator>(const Candidate& o) const { return rank != o.rank ? rank > o.rank : pos > o.pos; }
+    };
+    typedef std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> CandidateQueue;
 
-struct PairHash {
-    inline size_t operator()(const std::pair<int, int>& v) const {
-        // IntPairHash from boost (simplified)
-        size_t seed = 0;
-        seed ^= std::hash<int>{}(v.first) + 0x9e3779b9 + (seed<<6) + (seed>>2);
-        seed ^= std::hash<int>{}(v.second) + 0x9e3779b9 + (seed<<6) + (seed>>2);
-        return seed;
+    void push_candidate(const std::vector<Symbol>& syms, int pos, CandidateQueue& queue) const {
+        int next = syms[pos].next;
+        if (next == -1) return;
+        int rank, merged;
+        if (find_merge(syms[pos].id, syms[next].id, rank, merged)) queue.push({rank, pos, syms[pos].id, syms[next].id, merged});
     }
-};
 
-class BPEModel : public Model {
-public:
-    bool use_byte_level_;
-    std::unordered_map<std::string, int> vocab_;
-    std::unordered_map<int, std::string> id_to_token_;
-    std::unordered_map<std::pair<int, int>, int, PairHash> merges_;
-    mutable std::mutex cache_mutex_;
-    mutable std::unordered_map<std::string, std::vector<int>> cache_;
+    // Applies merges lowest rank first, leftmost first among equal ranks: O(n log n). The last
+    // merge applied is reported through `last` (rank -1 if none), and the index of the first
+    // input symbol of each output id through `starts`.
+    void merge_symbols(std::vector<int>& ids, Candidate* last = nullptr, std::vector<int>* starts = nullptr) const {
+        if (last) last->rank = -1;
+        if (starts) starts->clear();
+        if (ids.size() < 2) {
+            if (starts) starts->assign(ids.size(), 0);
+            return;
+        }
+        int n = (int)ids.size();
+        std::vector<Symbol> syms(n);
+        for (int i = 0; i < n; ++i) syms[i] = {ids[i], i - 1, i + 1 < n ? i + 1 : -1};
+        std::vector<Candidate> storage; storage.reserve(n);
+        CandidateQueue queue(std::greater<Candidate>(), std::move(storage));
+        for (int i = 0; i + 1 < n; ++i) push_candidate(syms, i, queue);
+        while (!queue.empty()) {
+            Candidate c = queue.top(); queue.pop();
+            Symbol& left = syms[c.pos];
+            if (left.id != c.left || left.next == -1 || syms[left.next].id != c.right) continue;
+            if (c.merged == -1) break;
+            Symbol& right = syms[left.next];
+            left.id = c.merged;
+            left.next = right.next;
+            if (right.next != -1) syms[right.next].prev = c.pos;
+            right.id = -1;
+            if (last) *last = c;
+            if (left.prev != -1) push_candidate(syms, left.prev, queue);
+            push_candidate(syms, c.pos, queue);
+        }
+        ids.clear();
+        for (int i = 0; i != -1; i = syms[i].next) {
+            ids.push_back(syms[i].id);
+            if (starts) starts->push_back(i);
+        }
+    }
 
-    BPEModel(const std::map<std::string, int>& vocab,
-             const std::map<std::pair<int, int>, int>& merges,
-             const std::map<std::string, int>& added_tokens,
-             bool use_byte_level,
-             bool byte_fallback)
-        : use_byte_level_(use_byte_level) {
-        for (auto const& x : vocab) { vocab_[x.first] = x.second; id_to_token_[x.second] = x.first; }
-        for (auto const& x : merges) merges_[x.first] = x.second;
+    // Linear-time encoder for byte-level vocabularies, after the backtracking encoder of the
+    // GitHub `bpe` crate: a token sequence is the BPE encoding of a text exactly when every
+    // adjacent pair is one BPE would leave apart, so the text can be matched greedily against
+    // the vocab and repaired locally, without simulating the merges.
+    struct Backtracking {
+        std::vector<int> rank;                   // rank of the merge forming each token, -1 for single bytes
+        std::vector<std::pair<int, int>> split;  // halves of that merge
+        std::vector<int> prefix;                 // longest reachable token that is a proper prefix, -1 if none
+        std::vector<int> length;                 // raw byte length, 0 for unreachable ids
+    };
+    std::unique_ptr<Backtracking> backtrack_;
+
+    // Keys raw_vocab_ by the raw bytes of every vocab entry spelled in byte symbols. Only built
+    // for byte-level vocabs, i.e. ones holding all 256 byte symbols or used on raw bytes.
+    void build_raw_vocab() {
+        if (!has_all_bytes_ && !use_byte_level_) return;
+        int max_id = -1;
+        for (const auto& x : id_to_token_) max_id = std::max(max_id, x.first);
+        std::vector<std::pair<std::string, int>> keys;
+        raw_begin_.assign(max_id + 2, 0);
+        raw_pool_.clear();
+        for (int id = 0; id <= max_id; ++id) {
+            raw_begin_[id] = (uint32_t)raw_pool_.size();
+            auto it = id_to_token_.find(id);
+            if (it == id_to_token_.end() || !append_raw_bytes(it->second, raw_pool_)) { raw_pool_.resize(raw_begin_[id]); continue; }
+            keys.push_back(std::make_pair(raw_pool_.substr(raw_begin_[id]), id));
+        }
+        raw_begin_[max_id + 1] = (uint32_t)raw_pool_.size();
+        raw_vocab_.build(keys);
+        token_node_.assign(max_id + 1, -1);
+        for (const auto& k : keys) {
+            int node = 0;
+            for (unsigned char c : k.first) raw_vocab_.next(node, c);
+            token_node_[k.second] = node;
+        }
     }
 
-    int token_to_id(const std::string& token) const override {
-        auto it = vocab_.find(token);
-        return (it != vocab_.end()) ? it->second : -1;
+    // A token is reachable when merge_symbols() turns its own bytes into it. The encoder only
+    // reproduces merge_symbols() when the merges are consistent with the vocab: every merge of two
+    // reachable tokens forms a reachable token, and ranks after every merge that can form either
+    // half (so merges are applied in rank order). Otherwise the heap merge stays in use.
+    void build_backtracking() {
+        backtrack_.reset();
+        if (!has_all_bytes_ || raw_vocab_.empty() || !has_merges()) return;
+        int max_id = (int)token_node_.size() - 1;
+        std::unique_ptr<Backtracking> bt(new Backtracking);
+        bt->rank.assign(max_id + 1, -1);
+        bt->split.assign(max_id + 1, std::make_pair(-1, -1));
+        bt->prefix.assign(max_id + 1, -1);
+        bt->length.assign(max_id + 1, 0);
+
+        std::vector<int> ids;
+        for (int id = 0; id <= max_id; ++id) {
+            if (token_node_[id] < 0) continue;
+            ids.clear();
+            for (uint32_t i = raw_begin_[id]; i < raw_begin_[id + 1]; ++i) ids.push_back(byte_to_id_[(unsigned char)raw_pool_[i]]);
+            Candidate last;
+            merge_symbols(ids, &last);
+            if (ids.size() != 1 || ids[0] != id) continue;
+            bt->rank[id] = last.rank;
+            bt->split[id] = std::make_pair(last.left, last.right);
+            bt->length[id] = (int)(raw_begin_[id + 1] - raw_begin_[id]);
+        }
+
+        auto reachable = [&](int id) { return id >= 0 && id <= max_id && bt->length[id] > 0; };
+        std::vector<int> max_formed(max_id + 1, -1);
+        bool consistent = true;
+        for_each_merge([&](int l, int r, int rank, int merged) {
+            if (!reachable(l) || !reachable(r)) return;
+            if (!reachable(merged)) consistent = false;
+            else max_formed[merged] = std::max(max_formed[merged], rank);
+        });
+        for_each_merge([&](int l, int r, int rank, int) {
+            if (reachable(l) && reachable(r) && (rank <= max_formed[l] || rank <= max_formed[r])) consistent = false;
+        });
+        if (!consistent) return;
+
+        for (int id = 0; id <= max_id; ++id) {
+            if (!reachable(id)) continue;
+            int node = 0;
+            for (uint32_t i = raw_begin_[id]; i + 1 < raw_begin_[id + 1]; ++i) {
+                raw_vocab_.next(node, (unsigned char)raw_pool_[i]);
+                if (reachable(raw_vocab_.value(node))) bt->prefix[id] = raw_vocab_.value(node);
+            }
+        }
+        backtrack_ = std::move(bt);
     }
-    std::string id_to_token(int id) const override {
-        auto it = id_to_token_.find(id);
-        return (it != id_to_token_.end()) ? it->second : "";
+
+    // Whether BPE leaves tokens a and b apart when encoding their concatenated bytes. The token
+    // at the end of a (and at the start of b) descends the right (left) spine of its merge tree,
+    // each one living from its own merge until its parent's. Walking both spines newest first,
+    // the pair breaks if a merge across the boundary ranks inside the lifetime of both sides; on
+    // a rank tie the leftmost merge wins, so the left side survives it and the right one does not.
+    bool is_valid_pair(int a, int b) const {
+        const Backtracking& bt = *backtrack_;
+        int a_end = INT_MAX, b_end = INT_MAX;
+        for (;;) {
+            int rank, merged;
+            if (find_merge(a, b, rank, merged) && rank < a_end && rank <= b_end) return false;
+            if (bt.rank[a] > bt.rank[b]) { a_end = bt.rank[a]; a = bt.split[a].second; }
+            else if (bt.rank[b] >= 0) { b_end = bt.rank[b]; b = bt.split[b].first; }
+            else return true;
+        }
     }
-    size_t vocab_size() const override { return vocab_.size(); }
 
-    std::vector<int> tokenize(const std::string& text) const override {
-        if (text.empty()) return {};
-        {
-            std::lock_guard<std::mutex> lock(cache_mutex_);
-            auto cit = cache_.find(text);
-            if (cit != cache_.end()) return cit->second;
+    // Longest reachable token at the start of text.
+    int longest_match(const char* text, size_t len) const {
+        const std::vector<int>& length = backtrack_->length;
+        int node = 0, id = -1;
+        for (size_t i = 0; i < len && raw_vocab_.next(node, (unsigned char)text[i]); ++i) {
+            int v = raw_vocab_.value(node);
+            if (v != -1 && length[v] > 0) id = v;
         }
+        return id;
+    }
 
-        std::vector<int> out;
-        if (use_byte_level_) {
-            static auto byte_map = create_bytes_char_map();
-            for (unsigned char b : text) {
-                int id = token_to_id(byte_map[b]);
-                if (id != -1) out.push_back(id);
-            }
-        } else {
-            const uint8_t* ptr = (const uint8_t*)text.c_str();
-            size_t len = text.length(), off = 0;
-            int32_t cp;
-            while (off < len) {
-                ssize_t ret = utf8proc_iterate(ptr + off, len - off, &cp);
-                if (ret <= 0) {
-                    char buf[16]; snprintf(buf, sizeof(buf), "<0x%02X>", (unsigned char)ptr[off]);
-                    int id = token_to_id(buf); if (id != -1) out.push_back(id);
-                    off++; continue;
+    // Takes the longest token at the cursor; if it cannot follow the previous token, tries its
+    // shorter prefixes, and when none fits pops the previous token and marks the position as a
+    // dead end. Dead ends are never revisited, which bounds the work by the text length.
+    void encode_backtracking(const char* text, size_t len, std::vector<int>& out) const {
+        const Backtracking& bt = *backtrack_;
+        std::vector<bool> open(len + 1, true);
+        out.clear();
+        size_t pos = 0;
+        int token = longest_match(text, len);
+        while (token != -1) {
+            int last = out.empty() ? -1 : out.back();
+            for (;;) {
+                size_t end = pos + bt.length[token];
+                if (open[end] && (last == -1 || is_valid_pair(last, token))) {
+                    out.push_back(token);
+                    pos = end;
+                    token = longest_match(text + pos, len - pos);
+                    break;
                 }
-                std::string s((const char*)ptr + off, ret);
-                int id = token_to_id(s);
-                if (id != -1) out.push_back(id);
-                else {
-                    for (size_t i = 0; i < (size_t)ret; ++i) {
-                        char buf[16]; snprintf(buf, sizeof(buf), "<0x%02X>", (unsigned char)ptr[off+i]);
-                        int bid = token_to_id(buf); if (bid != -1) out.push_back(bid);
-                    }
+                token = bt.prefix[token];
+                if (token == -1) {
+                    open[pos] = false;
+                    if (last == -1) break;
+                    out.pop_back();
+                    pos -= bt.length[last];
+                    token = last;
+                    break;
                 }
-                off += ret;
-            }
-        }
-        while (out.size() > 1) {
-            int best = -1, min_r = 1e9;
-            for (size_t i = 0; i < out.size() - 1; ++i) {
-                auto it = merges_.find({out[i], out[i+1]});
-                if (it != merges_.end() && it->second < min_r) { min_r = it->second; best = i; }
             }
-            if (best == -1) break;
-            std::string m = id_to_token(out[best]) + id_to_token(out[best+1]);
-            int nid = token_to_id(m); if (nid == -1) break;
-            out[best] = nid; out.erase(out.begin() + best + 1);
         }
-        {
-            std::lock_guard<std::mutex> lock(cache_mutex_);
-            cache_[text] = out;
+        if (pos != len) { // unreachable for consistent merges; keep the exact answer anyway
+            out.clear();
+            for (size_t i = 0; i < len; ++i) out.push_back(byte_to_id_[(unsigned char)text[i]]);
+            merge_symbols(out);
         }
-        return out;
     }
 
-    void load(const json& v, const json& m) {
-        for (auto it = v.begin(); it != v.end(); ++it) { vocab_[it.key()] = it.value().get<int>(); id_to_token_[it.value().get<int>()] = it.key(); }
-        int rank = 0;
-        for (const auto& item : m) {
-            std::string s1, s2;
-            if (item.is_string()) {
-                std::string line = item.get<std::string>(); size_t p = line.find(' ');
-                if (p != std::string::npos) { s1 = line.substr(0, p); s2 = line.substr(p + 1); }
-            } else if (item.is_array() && item.size() >= 2) { s1 = item[0].get<std::string>(); s2 = item[1].get<std::string>(); }
-            if (!s1.empty() && !s2.empty()) merges_[{token_to_id(s1), token_to_id(s2)}] = rank++;
+    enum { kMinSegment = 16 << 10 }; // smallest piece of a pre-token worth a task of its own
+
+    // Encodes equal byte segments of text concurrently, then stitches them left to right. Every
+    // adjacent pair inside a segment's encoding is already valid, so only the pair at each seam
+    // needs checking; when it is not valid, a window of tokens around the seam is re-encoded,
+    // doubling until it joins validly with both neighbours (at worst it covers everything). A
+    // sequence whose adjacent pairs are all valid is the BPE encoding, so the result is exact.
+    void encode_parallel(const std::string& text, std::vector<int>& out) const {
+        size_t segments = std::min<size_t>(parallel_threads_, text.size() / kMinSegment);
+        std::vector<size_t> bounds(segments + 1);
+        for (size_t i = 0; i <= segments; ++i) bounds[i] = text.size() * i / segments;
+        std::vector<std::vector<int>> parts(segments);
+        ThreadPool::instance().run(segments, [&](size_t i) {
+            encode_backtracking(text.data() + bounds[i], bounds[i + 1] - bounds[i], parts[i]);
+        });
+
+        const std::vector<int>& length = backtrack_->length;
+        out.swap(parts[0]);
+        std::vector<int> window;
+        for (size_t s = 1; s < segments; ++s) {
+            const std::vector<int>& next = parts[s];
+            size_t skip = 0; // leading tokens of `next` replaced by the window
+            for (size_t w = 1; !is_valid_pair(out.back(), next.front()); w *= 2) {
+                size_t left = std::min(w, out.size()), right = std::min(w, next.size());
+                size_t begin = bounds[s], end = bounds[s];
+                for (size_t i = 0; i < left; ++i) begin -= length[out[out.size() - 1 - i]];
+                for (size_t i = 0; i < right; ++i) end += length[next[i]];
+                encode_backtracking(text.data() + begin, end - begin, window);
+                bool left_ok = left == out.size() || is_valid_pair(out[out.size() - left - 1], window.front());
+                bool right_ok = right == next.size() || is_valid_pair(window.back(), next[right]);
+                if ((left_ok && right_ok) || (left == out.size() && right == next.size())) {
+                    out.resize(out.size() - left);
+                    out.insert(out.end(), window.begin(), window.end());
+                    skip = right;
+                    break;
+                }
+            }
+            out.insert(out.end(), next.begin() + skip, next.end());
         }
     }
 };
@@ -618,6 +3095,98 @@ class WordPieceModel : public Model {
     std::unordered_map<std::string, int> vocab_;
     std::unordered_map<int, std::string> id_to_token_;
     int unk_token_id_;
+
+    // LinMaxMatch (Song et al., "Fast WordPiece Tokenization"): one trie holds every token, and
+    // the node reached by the prefix ("##") is the root for continuation pieces. When a walk
+    // gets stuck at a node, the ids in its failure pops are the greedy longest-match tokens
+    // for the bytes walked so far, and its failure link is where the walk resumes.
+    struct Link { int fail; int pops_begin; int pops_len; };
+    DoubleArrayTrie trie_;
+    int suffix_root_ = 0;
+    std::vector<Link> links_;
+    std::vector<int> pops_;
+
+    void build_trie() {
+        std::vector<std::pair<std::string, int>> keys;
+        keys.reserve(vocab_.size() + 1);
+        // Makes sure the suffix root exists; a real "##" token overwrites the -1
+        if (!continuing_subword_prefix_.empty()) keys.push_back(std::make_pair(continuing_subword_prefix_, -1));
+        for (const auto& kv : vocab_) {
+            if (!kv.first.empty()) keys.push_back(std::make_pair(kv.first, kv.second));
+        }
+        trie_.build(keys);
+        suffix_root_ = 0;
+        for (unsigned char c : continuing_subword_prefix_) trie_.next(suffix_root_, c);
+
+        links_.assign(trie_.size(), Link{-1, 0, 0});
+        pops_.clear();
+        std::vector<int> queue(1, 0), extra;
+        if (suffix_root_ != 0) queue.push_back(suffix_root_);
+        for (size_t q = 0; q < queue.size(); ++q) {
+            int u = queue[q];
+            trie_.for_each_child(u, [&](unsigned char c, int v) {
+                if (v == suffix_root_) return;
+                queue.push_back(v);
+                Link& link = links_[v];
+                if (trie_.value(v) >= 0) {
+                    link = Link{suffix_root_, (int)pops_.size(), 1};
+                    pops_.push_back(trie_.value(v));
+                    return;
+                }
+                extra.clear();
+                int z = links_[u].fail;
+                int next = z;
+                while (z != -1 && !trie_.next(next, c)) {
+                    extra.insert(extra.end(), pops_.begin() + links_[z].pops_begin, pops_.begin() + links_[z].pops_begin + links_[z].pops_len);
+                    z = links_[z].fail;
+                    next = z;
+                }
+                if (z == -1) return;
+                link.fail = next;
+                link.pops_begin = (int)pops_.size();
+                link.pops_len = links_[u].pops_len + (int)extra.size();
+                for (int k = 0; k < links_[u].pops_len; ++k) pops_.push_back(pops_[links_[u].pops_begin + k]);
+                pops_.insert(pops_.end(), extra.begin(), extra.end());
+            });
+        }
+    }
+
+    void append_pops(int node, std::vector<int>& out) const {
+        const Link& l = links_[node];
+        out.insert(out.end(), pops_.begin() + l.pops_begin, pops_.begin() + l.pops_begin + l.pops_len);
+    }
+
+    // Greedy longest match by shrinking the candidate, kept for words that themselves start
+    // with the prefix: walking those from the root would pass through the suffix root.
+    void max_match(const std::string& text, std::vector<int>& out) const {
+        size_t first = out.size();
+        size_t start = 0;
+        while (start < text.length()) {
+            size_t end = text.length();
+            int cur_id = -1;
+
+            // Greedy match
+            while (end > start) {
+                std::string substr = text.substr(start, end - start);
+                if (start > 0) substr = continuing_subword_prefix_ + substr;
+                auto it = vocab_.find(substr);
+                if (it != vocab_.end()) {
+                    cur_id = it->second;
+                    break;
+                }
+                end--;
+            }
+
+            if (cur_id == -1) {
+                out.resize(first);
+                if (unk_token_id_ != -1) out.push_back(unk_token_id_);
+                return;
+            }
+            out.push_back(cur_id);
+            start = end;
+        }
+    }
+
 public:
     WordPieceModel(const std::string& unk = "[UNK]", const std::string& prefix = "##", int max_chars = 100)
         : unk_token_(unk), continuing_subword_prefix_(prefix), max_input_chars_per_word_(max_chars), unk_token_id_(-1) {}
@@ -629,6 +3198,7 @@ public:
         }
         auto it = vocab_.find(unk_token_);
         if (it != vocab_.end()) unk_token_id_ = it->second;
+        build_trie();
     }
 
     int token_to_id(const std::string& token) const override {
@@ -643,43 +3213,167 @@ public:
 
     size_t vocab_size() const override { return vocab_.size(); }
 
+    size_t memory_usage() const override {
+        return trie_.memory_usage() + links_.capacity() * sizeof(Link) + pops_.capacity() * sizeof(int);
+    }
+
     std::vector<int> tokenize(const std::string& text) const override {
-        if (text.empty()) return {};
+        std::vector<int> out;
+        tokenize_into(text, out);
+        return out;
+    }
+
+    void tokenize_into(const std::string& text, std::vector<int>& out) const override {
+        if (text.empty()) return;
         // If word is too long, return unk
         if ((int)text.length() > max_input_chars_per_word_) {
-            return unk_token_id_ != -1 ? std::vector<int>{unk_token_id_} : std::vector<int>{};
+            if (unk_token_id_ != -1) out.push_back(unk_token_id_);
+            return;
         }
-        std::vector<int> out;
-        size_t start = 0;
-        bool is_bad = false;
+        if (starts_with_prefix(text.data(), text.size())) return max_match(text, out);
 
-        while (start < text.length()) {
-            size_t end = text.length();
-            int cur_id = -1;
+        Walk w;
+        walk_begin(w, out);
+        for (unsigned char c : text) walk_byte(w, c, out);
+        walk_end(w, out);
+    }
 
-            // Greedy match
-            while (end > start) {
-                std::string substr = text.substr(start, end - start);
-                if (start > 0) substr = continuing_subword_prefix_ + substr;
-                auto it = vocab_.find(substr);
-                if (it != vocab_.end()) {
-                    cur_id = it->second;
+    // A word is unk as a whole or split into pieces that spell it, the first one as is and the
+    // others after the continuing prefix.
+    void tokenize_with_offsets(const std::string& text, std::vector<int>& out, std::vector<Offset>& offsets) const override {
+        size_t first = out.size(), pos = 0;
+        tokenize_into(text, out);
+        if (out.size() == first + 1) { offsets.push_back(Offset(0, text.size())); return; }
+        for (size_t k = first; k < out.size(); ++k) {
+            size_t n = id_to_token(out[k]).size() - (k > first ? continuing_subword_prefix_.size() : 0);
+            offsets.push_back(Offset(pos, pos + n));
+            pos += n;
+        }
+    }
+
+    const std::string& continuing_subword_prefix() const { return continuing_subword_prefix_; }
+
+    bool starts_with_prefix(const char* s, size_t len) const {
+        const std::string& prefix = continuing_subword_prefix_;
+        return !prefix.empty() && len >= prefix.size() && prefix.compare(0, prefix.size(), s, prefix.size()) == 0;
+    }
+
+    // Incremental form of tokenize_into for callers that produce a word a byte at a time. The
+    // word must not start with the continuing prefix (see max_match). A word that is too long
+    // or cannot be split becomes unk, or nothing when the vocab has no unk token.
+    struct Walk { int node; size_t first; size_t len; bool failed; };
+
+    void walk_begin(Walk& w, const std::vector<int>& out) const { w = Walk{0, out.size(), 0, false}; }
+
+    void walk_byte(Walk& w, unsigned char c, std::vector<int>& out) const {
+        if (w.failed || ++w.len > (size_t)max_input_chars_per_word_) { w.failed = true; return; }
+        while (!trie_.next(w.node, c)) {
+            if (links_[w.node].fail == -1) { w.failed = true; return; }
+            append_pops(w.node, out);
+            w.node = links_[w.node].fail;
+        }
+    }
+
+    void walk_end(Walk& w, std::vector<int>& out) const {
+        if (w.len > (size_t)max_input_chars_per_word_) {
+            out.resize(w.first);
+            if (unk_token_id_ != -1) out.push_back(unk_token_id_);
+            return;
+        }
+        // Drain what is left; a complete tokenization ends back at the suffix root
+        while (!w.failed && w.node != suffix_root_) {
+            if (links_[w.node].fail == -1) { w.failed = true; break; }
+            append_pops(w.node, out);
+            w.node = links_[w.node].fail;
+        }
+        if (w.failed) {
+            out.resize(w.first);
+            if (unk_token_id_ != -1) out.push_back(unk_token_id_);
+        }
+    }
+};
+
+// BertNormalizer + BertPreTokenizer + WordPiece in one pass: each input code point is
+// normalized, classified and fed byte by byte into the WordPiece walk, so no normalized
+// string or word list is built.
+class BertWordPieceEncoder {
+    std::shared_ptr<BertNormalizer> normalizer_;
+    std::shared_ptr<WordPieceModel> model_;
+    // What an ASCII byte becomes after normalization: dropped, a word boundary, a single
+    // punctuation word, or this byte inside a word.
+    enum Kind : unsigned char { kDrop, kSpace, kPunct, kWord };
+    Kind ascii_kind_[128];
+    char ascii_byte_[128];
+
+public:
+    BertWordPieceEncoder(std::shared_ptr<BertNormalizer> n, std::shared_ptr<WordPieceModel> m)
+        : normalizer_(n), model_(m) {
+        for (int c = 0; c < 128; ++c) {
+            int32_t mapped = -1;
+            normalizer_->map_codepoint(c, [&](int32_t x) { mapped = x; });
+            ascii_byte_[c] = (char)mapped;
+            if (mapped < 0) ascii_kind_[c] = kDrop;
+            else if (BertPreTokenizer::is_whitespace(mapped)) ascii_kind_[c] = kSpace;
+            else if (BertPreTokenizer::is_punctuation(mapped)) ascii_kind_[c] = kPunct;
+            else ascii_kind_[c] = kWord;
+        }
+    }
+
+    // Words starting with the continuing prefix need the fallback matcher, so the fused path
+    // only applies when no word can: a prefix opening with a separator, at least 2 long.
+    static bool usable(const WordPieceModel& m) {
+        const std::string& prefix = m.continuing_subword_prefix();
+        if (prefix.empty()) return true;
+        int32_t cp;
+        ssize_t r = utf8proc_iterate((const uint8_t*)prefix.data(), prefix.size(), &cp);
+        if (r <= 0 || (size_t)r == prefix.size()) return false;
+        return BertPreTokenizer::is_whitespace(cp) || BertPreTokenizer::is_punctuation(cp);
+    }
+
+    void encode(const std::string& text, std::vector<int>& out) const {
+        const WordPieceModel& wp = *model_;
+        WordPieceModel::Walk w;
+        bool in_word = false;
+        auto end_word = [&]() { if (in_word) { wp.walk_end(w, out); in_word = false; } };
+        auto feed = [&](int32_t c) {
+            if (BertPreTokenizer::is_whitespace(c)) { end_word(); return; }
+            bool punct = BertPreTokenizer::is_punctuation(c);
+            if (punct) end_word();
+            if (!in_word) { wp.walk_begin(w, out); in_word = true; }
+            char buf[4];
+            int n = utf8proc_encode_char(c, (utf8proc_uint8_t*)buf);
+            for (int k = 0; k < n; ++k) wp.walk_byte(w, (unsigned char)buf[k], out);
+            if (punct) end_word();
+        };
+
+        const uint8_t* p = (const uint8_t*)text.data();
+        size_t len = text.size(), i = 0;
+        while (i < len) {
+            if (p[i] < 0x80) {
+                unsigned char c = p[i++];
+                switch (ascii_kind_[c]) {
+                case kDrop: break;
+                case kSpace: end_word(); break;
+                case kPunct:
+                    end_word();
+                    wp.walk_begin(w, out);
+                    wp.walk_byte(w, (unsigned char)ascii_byte_[c], out);
+                    wp.walk_end(w, out);
+                    break;
+                case kWord:
+                    if (!in_word) { wp.walk_begin(w, out); in_word = true; }
+                    wp.walk_byte(w, (unsigned char)ascii_byte_[c], out);
                     break;
                 }
-                end--;
-            }
-
-            if (cur_id == -1) {
-                is_bad = true;
-                break;
-            } else {
-                out.push_back(cur_id);
-                start = end;
+                continue;
             }
+            int32_t cp;
+            ssize_t r = utf8proc_iterate(p + i, len - i, &cp);
+            if (r <= 0) { i++; continue; }
+            normalizer_->map_codepoint(cp, feed);
+            i += r;
         }
-
-        if (is_bad) return { unk_token_id_ };
-        return out;
+        end_word();
     }
 };
 
@@ -690,7 +3384,10 @@ class UnigramModel : public Model {
     std::unordered_map<int, std::string> id_to_token_;
     std::vector<double> scores_;
     bool byte_fallback_;
-    size_t max_token_len_ = 0;
+    DoubleArrayTrie pieces_; // piece bytes -> id, walked forward from each lattice position
+    int byte_ids_[256];      // id of the "<0xXX>" piece for each byte, unk when missing
+
+    double score_of(int id) const { return (id >= 0 && id < (int)scores_.size()) ? scores_[id] : -10.0; }
 
 public:
     UnigramModel(int unk_id = 0, bool byte_fallback = false)
@@ -698,6 +3395,7 @@ public:
 
     void load(const json& v) {
         int idx = 0;
+        std::vector<std::pair<std::string, int>> keys;
         for (const auto& item : v) {
             if (item.is_array() && item.size() >= 2) {
                 std::string token = item[0].get<std::string>();
@@ -705,11 +3403,18 @@ public:
                 vocab_[token] = idx;
                 id_to_token_[idx] = token;
                 scores_.push_back(score);
-                if (token.length() > max_token_len_) max_token_len_ = token.length();
+                if (!token.empty()) keys.push_back(std::make_pair(token, idx));
                 if (idx == unk_token_id_) unk_token_ = token;
                 idx++;
             }
         }
+        pieces_.build(keys);
+        for (int b = 0; b < 256; ++b) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "<0x%02X>", b);
+            auto it = vocab_.find(buf);
+            byte_ids_[b] = (it != vocab_.end()) ? it->second : unk_token_id_;
+        }
     }
 
     int token_to_id(const std::string& token) const override {
@@ -724,57 +3429,58 @@ public:
 
     size_t vocab_size() const override { return vocab_.size(); }
 
-    std::vector<int> tokenize(const std::string& text) const override {
-        if (text.empty()) return {};
+    size_t memory_usage() const override { return pieces_.memory_usage() + scores_.capacity() * sizeof(double); }
 
-        size_t n = text.length();
-        std::vector<double> best_scores(n + 1, -1e18);
-        std::vector<int> best_ids(n + 1, -1);
-        std::vector<size_t> best_prev_pos(n + 1, 0);
+    std::vector<int> tokenize(const std::string& text) const override {
+        std::vector<int> out;
+        tokenize_into(text, out);
+        return out;
+    }
 
-        best_scores[0] = 0.0;
+    void tokenize_into(const std::string& text, std::vector<int>& out) const override { encode(text, out, nullptr); }
 
-        for (size_t i = 1; i <= n; ++i) {
-            size_t start_len = (i > max_token_len_) ? (i - max_token_len_) : 0;
-            for (size_t j = i - 1; j != (size_t)-1 && j >= start_len; --j) { // Iterate backwards from i-1
-                if (best_scores[j] <= -1e17) continue;
+    void tokenize_with_offsets(const std::string& text, std::vector<int>& out, std::vector<Offset>& offsets) const override {
+        encode(text, out, &offsets);
+    }
 
-                std::string sub = text.substr(j, i - j);
-                auto it = vocab_.find(sub);
+private:
+    // Viterbi over the piece lattice; each id's range is the lattice edge it was taken from.
+    void encode(const std::string& text, std::vector<int>& out, std::vector<Offset>* offsets) const {
+        if (text.empty()) return;
 
-                int token_id = -1;
-                double score = -1e18;
+        // Lattice columns live in a per-thread workspace, so steady-state encoding allocates
+        // nothing. Pre-tokens longer than kRetainedColumns get a lattice of their own that is freed
+        // on return, which caps what each thread keeps. Scores stay double to keep tie-breaking identical.
+        struct Lattice { std::vector<double> score; std::vector<int> id; std::vector<size_t> prev; };
+        static const size_t kRetainedColumns = 16384;
+        static thread_local Lattice shared;
+        Lattice oversize;
+        size_t n = text.length();
+        Lattice& lat = n < kRetainedColumns ? shared : oversize;
+        if (lat.score.size() < n + 1) { lat.score.resize(n + 1); lat.id.resize(n + 1); lat.prev.resize(n + 1); }
+        double* best_scores = lat.score.data();
+        int* best_ids = lat.id.data();
+        size_t* best_prev_pos = lat.prev.data();
+        std::fill(best_scores, best_scores + n + 1, -1e18);
 
-                if (it != vocab_.end()) {
-                    token_id = it->second;
-                    score = scores_[token_id];
-                } else if (byte_fallback_ && (i - j) == 1) {
-                     unsigned char b = (unsigned char)text[j];
-                     char buf[16];
-                     snprintf(buf, sizeof(buf), "<0x%02X>", b);
-                     auto bf_it = vocab_.find(buf);
-                     if (bf_it != vocab_.end()) {
-                         token_id = bf_it->second;
-                         score = scores_[token_id];
-                     } else {
-                         token_id = unk_token_id_;
-                         score = (unk_token_id_ < (int)scores_.size()) ? scores_[unk_token_id_] : -10.0;
-                     }
-                } else {
-                     continue;
-                }
+        best_scores[0] = 0.0;
 
-                double new_score = best_scores[j] + score;
-                if (new_score > best_scores[i] || best_scores[i] <= -1e17) {
-                    best_scores[i] = new_score;
-                    best_prev_pos[i] = j;
-                    best_ids[i] = token_id;
-                }
+        // Forward lattice: every start j relaxes all the ends its pieces reach, so best_scores[j]
+        // is final once j is visited. ">=" lets the latest start win a tie, like the old
+        // end-major loop that tried starts from nearest to farthest and kept the first.
+        auto relax = [&](size_t j, size_t i, int id) {
+            double new_score = best_scores[j] + score_of(id);
+            if (new_score >= best_scores[i]) {
+                best_scores[i] = new_score;
+                best_prev_pos[i] = j;
+                best_ids[i] = id;
             }
+        };
 
+        for (size_t i = 0; i <= n; ++i) {
             // If unreachable, force greedy step with UNK as fallback if everything failed
             // (Only if not byte fallback, or byte fallback failed to match)
-            if (best_scores[i] <= -1e17) {
+            if (i > 0 && best_scores[i] <= -1e17) {
                 // Try to find the start of the current character (UTF-8)
                 int char_len = 1;
                 for (int k = 1; k <= 4 && (int)i - k >= 0; ++k) {
@@ -792,28 +3498,44 @@ public:
 
                  double prev_score = best_scores[i-char_len];
                  if (prev_score > -1e17) {
-                     double unk_score = (unk_token_id_ < (int)scores_.size()) ? scores_[unk_token_id_] : -10.0;
-                     best_scores[i] = prev_score + unk_score;
+                     best_scores[i] = prev_score + score_of(unk_token_id_);
                      best_prev_pos[i] = i - char_len;
                      best_ids[i] = unk_token_id_;
                  }
             }
+            if (i == n || best_scores[i] <= -1e17) continue;
+
+            // One trie walk enumerates every piece that starts at i
+            int node = 0;
+            bool single = false;
+            for (size_t e = i; e < n && pieces_.next(node, (unsigned char)text[e]); ++e) {
+                int id = pieces_.value(node);
+                if (id < 0) continue;
+                relax(i, e + 1, id);
+                if (e == i) single = true;
+            }
+            if (!single && byte_fallback_) relax(i, i + 1, byte_ids_[(unsigned char)text[i]]);
         }
 
-        std::vector<int> out;
-        if (best_scores[n] <= -1e17) return {};
+        if (best_scores[n] <= -1e17) return;
 
+        // Backtrack straight into out, then flip the appended range in place
+        size_t first = out.size(), first_offset = offsets ? offsets->size() : 0;
         size_t cur = n;
         while (cur > 0) {
              int id = best_ids[cur];
+             size_t prev = best_prev_pos[cur];
              // Merge contiguous UNKs
-             if (out.empty() || id != unk_token_id_ || out.back() != unk_token_id_) {
+             if (out.size() == first || id != unk_token_id_ || out.back() != unk_token_id_) {
                  out.push_back(id);
+                 if (offsets) offsets->push_back(Offset(prev, cur));
+             } else if (offsets) {
+                 offsets->back().first = prev;
              }
-             cur = best_prev_pos[cur];
+             cur = prev;
         }
-        std::reverse(out.begin(), out.end());
-        return out;
+        std::reverse(out.begin() + first, out.end());
+        if (offsets) std::reverse(offsets->begin() + first_offset, offsets->end());
     }
 };
 
@@ -836,18 +3558,19 @@ public:
 
 
 class ReplaceDecoder : public Decoder {
-    std::string pattern_, content_;
+    MultiReplacer replacer_;
 public:
-    ReplaceDecoder(const std::string& p, const std::string& c) : pattern_(p), content_(c) {}
+    ReplaceDecoder(const std::string& p, const std::string& c)
+        : replacer_(std::vector<MultiReplacer::Rule>(p.empty() ? 0 : 1, MultiReplacer::Rule(p, c))) {}
+    explicit ReplaceDecoder(const std::vector<MultiReplacer::Rule>& rules) : replacer_(rules) {}
     void decode(std::vector<std::string>& tokens) const override {
+        std::string out;
         for (auto& t : tokens) {
-            size_t pos = 0;
-            while ((pos = t.find(pattern_, pos)) != std::string::npos) {
-                t.replace(pos, pattern_.length(), content_);
-                pos += content_.length();
-            }
+            out.clear();
+            if (replacer_.apply(t, out)) t.swap(out);
         }
     }
+    const std::vector<MultiReplacer::Rule>& rules() const { return replacer_.rules(); }
 };
 
 class StripDecoder : public Decoder {
@@ -1028,15 +3751,25 @@ struct PreTrainedTokenizer::Impl {
     struct { int pad=-1, bos=-1, eos=-1, unk=-1; } special_tokens_;
     std::shared_ptr<OnigRegex> added_tokens_regex_;
     std::vector<AddedToken> added_tokens_;
+    std::shared_ptr<BertWordPieceEncoder> bert_encoder_; // fused normalizer/pre-tokenizer/model, if applicable
     std::string chat_template_;
     std::shared_ptr<jinja::Template> jinja_template_;
 
-    std::vector<int> encode(const PreTrainedTokenizer* public_api, const std::string& text, bool add_special_tokens) const {
+    // offsets, if given, receives the source range of each id (see encode_with_offsets()).
+    std::vector<int> encode(const PreTrainedTokenizer* public_api, const std::string& text, bool add_special_tokens,
+                            std::vector<Offset>* offsets = nullptr) const {
+        if (offsets) offsets->clear();
         if (text.empty()) return {};
         std::vector<int> input_ids;
 
-        // 1. Identify added tokens in original text (assuming normalized: false for most)
-        std::vector<std::pair<std::string, bool>> units;
+        if (add_special_tokens && special_tokens_.bos != -1) {
+            input_ids.push_back(special_tokens_.bos);
+            if (offsets) offsets->push_back(Offset(0, 0));
+        }
+
+        // 1. Identify added tokens in original text (assuming normalized: false for most); each
+        // unit is encoded as soon as it is found
+        static thread_local std::string piece;
         size_t last = 0;
         while (last < text.length()) {
             int match_start = -1, match_end = -1;
@@ -1058,38 +3791,89 @@ struct PreTrainedTokenizer::Impl {
                     }
                 }
 
-                if (prefix_end > prefix_start) units.push_back({text.substr(prefix_start, prefix_end - prefix_start), false});
-                units.push_back({match_token, true});
+                if (prefix_end > prefix_start) {
+                    piece.assign(text, prefix_start, prefix_end - prefix_start);
+                    encode_unit(piece, prefix_start, input_ids, offsets);
+                }
+                int id = public_api->token_to_id(match_token);
+                if (id != -1) input_ids.push_back(id);
+                if (id != -1 && offsets) offsets->push_back(Offset(match_start, match_end));
                 last = next_start;
+            } else if (last == 0) {
+                encode_unit(text, 0, input_ids, offsets);
+                break;
             } else {
-                units.push_back({text.substr(last), false});
+                piece.assign(text, last, std::string::npos);
+                encode_unit(piece, last, input_ids, offsets);
                 break;
             }
         }
+        return input_ids;
+    }
 
-        if (add_special_tokens && special_tokens_.bos != -1) input_ids.push_back(special_tokens_.bos);
+    // Steps 2-3 of encode() for the text between added tokens, starting at byte `begin` of the
+    // input. Pre-tokens are handed to the model as the pre-tokenizer finds them, so the model
+    // appends ids straight to `ids` and no list of splits is built.
+    void encode_unit(const std::string& text, size_t begin, std::vector<int>& ids, std::vector<Offset>* offsets) const {
+        if (offsets) { encode_aligned(text, begin, ids, *offsets); return; }
+        if (bert_encoder_) { bert_encoder_->encode(text, ids); return; }
 
-        for (const auto& unit : units) {
-            if (unit.second) {
-                int id = public_api->token_to_id(unit.first);
-                if (id != -1) input_ids.push_back(id);
-            } else {
-                // 2. Normalize only non-special units
-                std::string normalized = normalizer_ ? normalizer_->normalize(unit.first) : unit.first;
-                if (normalized.empty()) continue;
+        // 2. Normalize only non-special units
+        static thread_local std::string norm_buf;
+        bool changed = normalizer_ && normalizer_->normalize_into(text, norm_buf);
+        const std::string& normalized = changed ? norm_buf : text;
+        if (normalized.empty()) return;
 
-                // 3. Pre-tokenize and model tokenize
-                PreTokenizedString pts; pts.splits.push_back(normalized);
+        // 3. Pre-tokenize and model tokenize
+        static thread_local std::string word;
+        auto to_model = [this, &ids](const char* s, size_t n) {
+            word.assign(s, n);
+            model_->tokenize_into(word, ids);
+        };
+        if (pre_tokenizer_) pre_tokenizer_->pre_tokenize_stream(normalized.data(), normalized.size(), to_model);
+        else to_model(normalized.data(), normalized.size());
+    }
 
-                if (pre_tokenizer_) pre_tokenizer_->pre_tokenize(pts);
+    // Steps 2-3 of encode() for a unit starting at byte `begin` of the input, tracking where
+    // every byte came from: the normalizer's alignment seeds the pre-tokenized splits, and the
+    // model's offsets within a split are mapped through them. Takes the unfused path, which
+    // gives the same ids as bert_encoder_.
+    void encode_aligned(const std::string& text, size_t begin, std::vector<int>& ids, std::vector<Offset>& offsets) const {
+        PreTokenizedString pts;
+        pts.track = true;
+        if (!normalizer_ || !normalizer_->normalize_aligned(text, pts.buffer, pts.align)) {
+            pts.buffer = text;
+            pts.align.clear();
+            Alignment{pts.align}.copy(0, text.size());
+        }
+        if (pts.buffer.empty()) return;
+        pts.splits.assign(1, Span{0, pts.buffer.size()});
+        for (auto& a : pts.align) { a.first += begin; a.second += begin; }
 
-                for (const auto& s : pts.splits) {
-                    auto ids = model_->tokenize(s);
-                    input_ids.insert(input_ids.end(), ids.begin(), ids.end());
-                }
-            }
+        if (pre_tokenizer_) pre_tokenizer_->pre_tokenize(pts);
+
+        std::vector<Offset> local;
+        std::string word;
+        for (const Span& split : pts.splits) {
+            local.clear();
+            word.assign(pts.buffer, split.offset, split.length);
+            model_->tokenize_with_offsets(word, ids, local);
+            const Offset* a = pts.align.data() + split.offset;
+            for (const auto& o : local) offsets.push_back(span_of(a, split.length, o.first, o.second));
         }
-        return input_ids;
+    }
+
+    // The ByteLevel pre-tokenizer if it is the only one and runs last, else null.
+    static std::shared_ptr<ByteLevelPreTokenizer> trailing_byte_level(const std::shared_ptr<PreTokenizer>& pt) {
+        auto seq = std::dynamic_pointer_cast<SequencePreTokenizer>(pt);
+        if (!seq) return std::dynamic_pointer_cast<ByteLevelPreTokenizer>(pt);
+        std::shared_ptr<ByteLevelPreTokenizer> found;
+        for (const auto& p : seq->pts_) {
+            auto bl = std::dynamic_pointer_cast<ByteLevelPreTokenizer>(p);
+            if (bl && found) return nullptr;
+            if (bl) found = bl;
+        }
+        return (found && seq->pts_.back() == found) ? found : nullptr;
     }
 
     void set_clean_up_tokenization_spaces(bool clean) {
@@ -1134,27 +3918,7 @@ struct PreTrainedTokenizer::Impl {
                 this->model_ = ug;
             } else {
                 // BPE model (default)
-                auto vocab = j["model"]["vocab"].get<std::map<std::string, int>>();
-                std::map<std::pair<int, int>, int> merges;
-                if (j["model"].contains("merges")) {
-                    int rank = 0;
-                    for (const auto& item : j["model"]["merges"]) {
-                        std::string s1, s2;
-                        if (item.is_string()) {
-                            std::string line = item.get<std::string>();
-                            size_t pos = line.find(' ');
-                            if (pos != std::string::npos) { s1 = line.substr(0, pos); s2 = line.substr(pos + 1); }
-                        } else if (item.is_array() && item.size() >= 2) {
-                            s1 = item[0].get<std::string>();
-                            s2 = item[1].get<std::string>();
-                        }
-                        if (!s1.empty() && !s2.empty() && vocab.count(s1) && vocab.count(s2))
-                            merges[{vocab[s1], vocab[s2]}] = rank++;
-                    }
-                }
-                std::map<std::string, int> added_tokens;
-                bool byte_fallback = false;
-                if (j["model"].contains("byte_fallback")) byte_fallback = j["model"]["byte_fallback"].get<bool>();
+                bool ignore_merges = j["model"].value("ignore_merges", false);
 
                 bool use_byte_level = false;
                 auto check_bl = [](const json& c) -> bool {
@@ -1185,7 +3949,8 @@ struct PreTrainedTokenizer::Impl {
                     }
                 }
 
-                auto bpe = std::make_shared<BPEModel>(vocab, merges, added_tokens, use_byte_level && !pt_has_byte_level, byte_fallback);
+                auto bpe = std::make_shared<BPEModel>(use_byte_level && !pt_has_byte_level, ignore_merges);
+                bpe->load(j["model"]["vocab"], j["model"].contains("merges") ? j["model"]["merges"] : json());
                 this->model_ = bpe;
             }
         }
@@ -1194,8 +3959,10 @@ struct PreTrainedTokenizer::Impl {
                 std::string type = s.value("type", "");
                 if (type == "NFKC") return std::make_shared<NFKCNormalizer>();
                 if (type == "Precompiled") {
-                    // Precompiled usually implies NFKC + some char map.
-                    // For GTE/XLM-R, it seems to map ZWJ (\u200d) to space, causing split.
+                    auto pc = std::make_shared<PrecompiledNormalizer>();
+                    if (s.contains("precompiled_charsmap") && s["precompiled_charsmap"].is_string() &&
+                        pc->load(s["precompiled_charsmap"].get<std::string>())) return pc;
+                    // No usable charsmap: approximate with NFKC, and ZWJ (\u200d) to space as GTE/XLM-R do.
                     std::vector<std::shared_ptr<Normalizer>> norms;
                     norms.push_back(std::make_shared<NFKCNormalizer>());
                     norms.push_back(std::make_shared<ReplaceNormalizer>("\xE2\x80\x8D", " ")); // ZWJ -> Space
@@ -1204,7 +3971,7 @@ struct PreTrainedTokenizer::Impl {
                 if (type == "Prepend") return std::make_shared<PrependNormalizer>(s.value("prepend", ""));
                 if (type == "Lowercase") return std::make_shared<BertNormalizer>(false, false, false, true);
                 if (type == "StripAccents") return std::make_shared<BertNormalizer>(false, false, true, false);
-                if (type == "NFKD") return std::make_shared<NFKCNormalizer>(); // Approximate with NFKC for now
+                if (type == "NFKD") return std::make_shared<NFKCNormalizer>(false);
                 if (type == "Replace") {
                     std::string p;
                     if (s.contains("pattern") && s["pattern"].is_object()) p = s["pattern"].value("String", "");
@@ -1230,7 +3997,16 @@ struct PreTrainedTokenizer::Impl {
                 std::vector<std::shared_ptr<Normalizer>> norms;
                 for (const auto& s : j["normalizer"]["normalizers"]) {
                     auto n = create_norm(s);
-                    if (n) norms.push_back(n);
+                    if (!n) continue;
+                    // Adjacent Replace steps that cannot interact run as one pass
+                    auto cur = std::dynamic_pointer_cast<ReplaceNormalizer>(n);
+                    auto prev = norms.empty() ? nullptr : std::dynamic_pointer_cast<ReplaceNormalizer>(norms.back());
+                    if (cur && prev) {
+                        std::vector<MultiReplacer::Rule> rules = prev->rules();
+                        rules.insert(rules.end(), cur->rules().begin(), cur->rules().end());
+                        if (MultiReplacer::can_fuse(rules)) { norms.back() = std::make_shared<ReplaceNormalizer>(rules); continue; }
+                    }
+                    norms.push_back(n);
                 }
                 this->normalizer_ = std::make_shared<SequenceNormalizer>(norms);
             } else {
@@ -1258,7 +4034,15 @@ struct PreTrainedTokenizer::Impl {
                 std::vector<std::shared_ptr<Decoder>> decs;
                 for (const auto& s : j["decoder"]["decoders"]) {
                     auto d = create_dec(s);
-                    if (d) decs.push_back(d);
+                    if (!d) continue;
+                    auto cur = std::dynamic_pointer_cast<ReplaceDecoder>(d);
+                    auto prev = decs.empty() ? nullptr : std::dynamic_pointer_cast<ReplaceDecoder>(decs.back());
+                    if (cur && prev) {
+                        std::vector<MultiReplacer::Rule> rules = prev->rules();
+                        rules.insert(rules.end(), cur->rules().begin(), cur->rules().end());
+                        if (MultiReplacer::can_fuse(rules)) { decs.back() = std::make_shared<ReplaceDecoder>(rules); continue; }
+                    }
+                    decs.push_back(d);
                 }
                 this->decoder_ = std::make_shared<SequenceDecoder>(decs);
             } else {
@@ -1306,6 +4090,18 @@ struct PreTrainedTokenizer::Impl {
                 this->pre_tokenizer_ = create_pt(pt);
             }
         }
+        // Byte-level BPE: when ByteLevel is the last pre-tokenization step, hand its raw bytes
+        // straight to the model instead of building the remapped unicode strings.
+        auto bpe = std::dynamic_pointer_cast<BPEModel>(this->model_);
+        auto blpt = trailing_byte_level(this->pre_tokenizer_);
+        if (bpe && blpt && bpe->enable_raw_bytes()) blpt->set_emit_raw_bytes(true);
+        // BERT-style pipelines run fused; pre_tokenizer_ and normalizer_ stay for everything else.
+        auto bert_norm = std::dynamic_pointer_cast<BertNormalizer>(this->normalizer_);
+        auto wp = std::dynamic_pointer_cast<WordPieceModel>(this->model_);
+        if (bert_norm && wp && std::dynamic_pointer_cast<BertPreTokenizer>(this->pre_tokenizer_) &&
+            BertWordPieceEncoder::usable(*wp)) {
+            this->bert_encoder_ = std::make_shared<BertWordPieceEncoder>(bert_norm, wp);
+        }
         if (j.contains("post_processor") && !j["post_processor"].is_null()) {
             auto pp = j["post_processor"];
             auto ptl = [&](const json& s) {
@@ -1366,6 +4162,10 @@ std::vector<int> PreTrainedTokenizer::encode(const std::string& text, bool add_s
     return impl_->encode(this, text, add_special_tokens);
 }
 
+std::vector<int> PreTrainedTokenizer::encode_with_offsets(const std::string& text, std::vector<Offset>& offsets, bool add_special_tokens) const {
+    return impl_->encode(this, text, add_special_tokens, &offsets);
+}
+
 std::string PreTrainedTokenizer::decode(const std::vector<int>& ids, bool skip_special_tokens) const {
     std::vector<std::string> tokens;
     for (int id : ids) {
@@ -1427,6 +4227,26 @@ void PreTrainedTokenizer::set_clean_up_tokenization_spaces(bool clean) {
     impl_->set_clean_up_tokenization_spaces(clean);
 }
 
+void PreTrainedTokenizer::set_cache_capacity(size_t max_entries, size_t max_bytes) {
+    if (impl_->model_) impl_->model_->set_cache_capacity(max_entries, max_bytes);
+}
+
+CacheStats PreTrainedTokenizer::cache_stats() const {
+    return impl_->model_ ? impl_->model_->cache_stats() : CacheStats();
+}
+
+void PreTrainedTokenizer::clear_cache() {
+    if (impl_->model_) impl_->model_->clear_cache();
+}
+
+void PreTrainedTokenizer::set_parallel_encode(int threads, size_t min_bytes) {
+    if (impl_->model_) impl_->model_->set_parallel_encode(threads, min_bytes);
+}
+
+size_t PreTrainedTokenizer::model_memory_usage() const {
+    return impl_->model_ ? impl_->model_->memory_usage() : 0;
+}
+
 // ==========================================
 // AutoTokenizer Implementation
 // ==========================================
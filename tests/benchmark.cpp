@@ -0,0 +1,150 @@
+/**
+ * benchmark.cpp - Tokenizer Encode Benchmark
+ *
+ * 遍历 tests/models/ 目录下的模型，用 test_cases.jsonl 中的文本作为语料，
+ * 分别以 1, 2, 4, ... 个线程共享同一个 tokenizer 并发 encode，统计吞吐 (MB/s 与按空白切分的
+ * words/s) 与加速比。
+ *
+ * 用法: ./benchmark [models_path] [model_filter] [max_threads] [rounds]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cctype>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+#include <sys/stat.h>
+#include "tokenizer.hpp"
+#include "ujson.hpp"
+
+using json = ujson::json;
+
+static std::vector<std::string> list_model_dirs(const std::string& models_path) {
+    std::vector<std::string> dirs;
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind = FindFirstFileA((models_path + "/*").c_str(), &fd);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            std::string name = fd.cFileName;
+            if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && name != "." && name != "..") dirs.push_back(name);
+        } while (FindNextFileA(hFind, &fd));
+        FindClose(hFind);
+    }
+#else
+    DIR* dir = opendir(models_path.c_str());
+    if (!dir) return dirs;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        struct stat st;
+        if (stat((models_path + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) dirs.push_back(name);
+    }
+    closedir(dir);
+#endif
+    std::sort(dirs.begin(), dirs.end());
+    return dirs;
+}
+
+// 读取 basic 用例的 input 与 chat 用例的 formatted_text 作为语料
+static std::vector<std::string> load_corpus(const std::string& model_path) {
+    std::vector<std::string> corpus;
+    std::ifstream f(model_path + "/test_cases.jsonl");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty()) continue;
+        try {
+            json tc = json::parse(line);
+            std::string type = tc.value("type", "basic");
+            if (type == "basic" && tc.contains("input")) corpus.push_back(tc["input"].get<std::string>());
+            else if (type == "chat" && tc.contains("formatted_text")) corpus.push_back(tc["formatted_text"].get<std::string>());
+        } catch (const std::exception&) {}
+    }
+    return corpus;
+}
+
+// 按空白切分统计词数，用于 words/s
+static size_t count_words(const std::string& s) {
+    size_t words = 0;
+    bool in_word = false;
+    for (unsigned char c : s) {
+        bool space = std::isspace(c) != 0;
+        if (!space && !in_word) ++words;
+        in_word = !space;
+    }
+    return words;
+}
+
+// 每个线程把整个语料 encode rounds 遍，返回总耗时 (ms)
+static double run(const tokenizer::PreTrainedTokenizer& tok, const std::vector<std::string>& corpus, int threads, int rounds) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&tok, &corpus, rounds, t]() {
+            size_t n = corpus.size();
+            for (int r = 0; r < rounds; ++r) {
+                // 各线程从不同位置开始，避免所有线程同时处理同一段文本
+                for (size_t i = 0; i < n; ++i) tok.encode(corpus[(i + t * 7) % n], false);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string models_path = argc > 1 ? argv[1] : "../tests/models";
+    std::string model_filter = argc > 2 ? argv[2] : "";
+    int max_threads = argc > 3 ? std::atoi(argv[3]) : (int)std::max(1u, std::thread::hardware_concurrency());
+    int rounds = argc > 4 ? std::atoi(argv[4]) : 20;
+
+    std::vector<std::string> model_dirs = list_model_dirs(models_path);
+    if (model_dirs.empty()) {
+        std::cerr << "No models found!" << std::endl;
+        return 1;
+    }
+
+    std::cout << "threads: 1.." << max_threads << ", rounds: " << rounds << std::endl;
+    for (const std::string& model_name : model_dirs) {
+        if (!model_filter.empty() && model_name.find(model_filter) == std::string::npos) continue;
+        std::string model_path = models_path + "/" + model_name;
+        auto tok = tokenizer::AutoTokenizer::from_pretrained(model_path);
+        std::vector<std::string> corpus = load_corpus(model_path);
+        if (!tok || corpus.empty()) continue;
+
+        size_t corpus_bytes = 0, corpus_words = 0;
+        for (const auto& s : corpus) { corpus_bytes += s.size(); corpus_words += count_words(s); }
+
+        std::cout << "== " << model_name << " (" << corpus.size() << " texts, " << corpus_bytes << " bytes, " << corpus_words << " words)" << std::endl;
+        run(*tok, corpus, 1, 1); // 预热 word cache
+        std::vector<int> thread_counts;
+        for (int t = 1; t < max_threads; t *= 2) thread_counts.push_back(t);
+        thread_counts.push_back(max_threads);
+        double base_mbps = 0;
+        for (int threads : thread_counts) {
+            double ms = run(*tok, corpus, threads, rounds);
+            double mbps = (double)corpus_bytes * rounds * threads / (ms / 1000.0) / (1024.0 * 1024.0);
+            double kwps = (double)corpus_words * rounds * threads / ms;
+            if (threads == 1) base_mbps = mbps;
+            tokenizer::CacheStats cs = tok->cache_stats();
+            double hit_rate = cs.hits + cs.misses ? 100.0 * cs.hits / (cs.hits + cs.misses) : 0.0;
+            std::cout << "   threads " << std::setw(3) << threads
+                      << "  " << std::fixed << std::setprecision(2) << std::setw(9) << mbps << " MB/s"
+                      << "  " << std::setw(9) << kwps << "k words/s"
+                      << "  speedup " << std::setw(6) << mbps / base_mbps << "x"
+                      << "  cache hit " << std::setprecision(1) << hit_rate << "%" << std::endl;
+        }
+    }
+    return 0;
+}
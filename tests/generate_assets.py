@@ -3,6 +3,7 @@ import shutil
 import json
 from modelscope.hub.file_download import model_file_download
 from transformers import AutoTokenizer
+from tokenizers import Tokenizer
 
 # ================= 配置区域 =================
 
@@ -333,6 +334,16 @@ CHAT_TEST_CORPUS = [
 
 # ================= 功能函数 =================
 
+def raw_offsets(backend, text):
+    """
+    不经 post_processor (避免 trim_offsets 等改写) 编码 text，返回每个 token 的 UTF-8 字节偏移
+    HF 的偏移以字符计，这里换算成字节，与 encode_with_offsets 一致
+    """
+    byte_at = [0]
+    for ch in text:
+        byte_at.append(byte_at[-1] + len(ch.encode("utf-8")))
+    return [[byte_at[b], byte_at[e]] for b, e in backend.encode(text, add_special_tokens=False).offsets]
+
 def generate_test_cases(tokenizer, output_dir):
     """
     使用加载好的 tokenizer 生成测试用例
@@ -343,6 +354,10 @@ def generate_test_cases(tokenizer, output_dir):
     cases_path = os.path.join(output_dir, "test_cases.jsonl")
     print(f"  🧪 生成测试用例 -> {cases_path}")
 
+    config = json.loads(tokenizer.backend_tokenizer.to_str())
+    config["post_processor"] = None
+    backend = Tokenizer.from_str(json.dumps(config))
+
     with open(cases_path, "w", encoding="utf-8") as f:
         # ===== 1. 基础 Tokenization 测试 =====
         for text in TEST_CORPUS:
@@ -358,6 +373,7 @@ def generate_test_cases(tokenizer, output_dir):
                     "type": "basic",
                     "input": text,
                     "ids_raw": enc_raw["input_ids"],
+                    "offsets_raw": raw_offsets(backend, text),
                     "tokens_raw": tokens_raw,
                     "ids_full": enc_full["input_ids"],
                     "decoded_full": tokenizer.decode(enc_full["input_ids"], skip_special_tokens=True),
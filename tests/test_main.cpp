@@ -19,6 +19,9 @@
 #include <vector>
 #include <iomanip>
 #include <algorithm>
+#include <map>
+#include <random>
+#include <sstream>
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -165,7 +168,15 @@ struct TestResult {
     int skipped = 0;
 };
 
-// 运行 basic 类型测试 (纯 tokenization + decode)
+// 字节偏移扩展到字符边界: HF 的偏移以字符计，字节级 BPE 把一个字符拆成多个 token 时每个都覆盖整个字符
+tokenizer::Offset widen_to_chars(const std::string& text, tokenizer::Offset o) {
+    auto inside = [&](size_t i) { return i < text.size() && ((unsigned char)text[i] & 0xC0) == 0x80; };
+    while (o.first > 0 && inside(o.first)) o.first--;
+    while (inside(o.second)) o.second++;
+    return o;
+}
+
+// 运行 basic 类型测试 (纯 tokenization + decode，有 offsets_raw 时再比较 encode_with_offsets)
 bool run_basic_test(tokenizer::PreTrainedTokenizer* tok, const json& test_case, bool verbose = false) {
     std::string input = test_case["input"];
     std::vector<int> expected_ids = test_case["ids_raw"].get<std::vector<int>>();
@@ -186,7 +197,17 @@ bool run_basic_test(tokenizer::PreTrainedTokenizer* tok, const json& test_case,
     }
     bool decode_match = (decoded_text == expected_decode);
 
-    if (ids_match && decode_match) {
+    // 3. 测试 Offsets (HF 不经 post_processor 的字节偏移)
+    std::vector<tokenizer::Offset> expected_offsets, offsets;
+    bool offsets_match = true;
+    if (test_case.contains("offsets_raw")) {
+        for (const auto& o : test_case["offsets_raw"]) expected_offsets.push_back({o[0].get<size_t>(), o[1].get<size_t>()});
+        std::vector<int> ids = tok->encode_with_offsets(input, offsets, false);
+        for (auto& o : offsets) o = widen_to_chars(input, o);
+        offsets_match = (ids == expected_ids && offsets == expected_offsets);
+    }
+
+    if (ids_match && decode_match && offsets_match) {
         return true;
     } else {
         if (verbose) {
@@ -208,6 +229,15 @@ bool run_basic_test(tokenizer::PreTrainedTokenizer* tok, const json& test_case,
                 std::cout << Color::GREY << "     │ Decoded:  " << Color::RESET << "#" << visualize(decoded_text) << "#" << std::endl;
             }
 
+            if (!offsets_match) {
+                std::cout << Color::RED << "     ├── Offsets Mismatch ❌" << Color::RESET << std::endl;
+                std::cout << Color::GREY << "     │ Expected: ";
+                for (const auto& o : expected_offsets) std::cout << "(" << o.first << "," << o.second << ") ";
+                std::cout << std::endl << "     │ Got:      ";
+                for (const auto& o : offsets) std::cout << "(" << o.first << "," << o.second << ") ";
+                std::cout << Color::RESET << std::endl;
+            }
+
             std::cout << Color::GREY << "     └──────────────────────────────────────────────────" << Color::RESET << std::endl;
         }
         return false;
@@ -278,6 +308,87 @@ bool run_chat_test(tokenizer::PreTrainedTokenizer* tok, const json& test_case, b
     }
 }
 
+// 运行 WordPiece 参照测试: 逐词与朴素的贪心最长匹配 (HF WordPiece 的定义) 比较，
+// 覆盖超过 max_input_chars_per_word 的词、无法切分时的 unk 回退以及以不完整匹配结尾的词
+bool run_wordpiece_test(tokenizer::PreTrainedTokenizer* tok, const json& model, bool verbose = false) {
+    std::string prefix = model.value("continuing_subword_prefix", "##");
+    size_t max_chars = model.value("max_input_chars_per_word", 100);
+
+    // WordPiece 的 token_to_id 对未知词返回 unk，参照实现直接查词表;
+    // 只取纯小写 ASCII 的词表项造词，BERT 的 normalizer/pre-tokenizer 不会改动它们
+    std::map<std::string, int> ids;
+    std::vector<std::string> heads, tails;
+    const json& vocab = model["vocab"];
+    for (auto it = vocab.begin(); it != vocab.end(); ++it) {
+        std::string piece = it.key();
+        ids[piece] = it.value().get<int>();
+        bool tail = piece.compare(0, prefix.size(), prefix) == 0 && piece.size() > prefix.size();
+        if (tail) piece = piece.substr(prefix.size());
+        if (piece.empty() || piece.find_first_not_of("abcdefghijklmnopqrstuvwxyz") != std::string::npos) continue;
+        (tail ? tails : heads).push_back(piece);
+    }
+    if (heads.empty() || tails.empty()) return true;
+    auto unk_it = ids.find(model.value("unk_token", "[UNK]"));
+    int unk = unk_it != ids.end() ? unk_it->second : -1;
+
+    std::mt19937 rng(42);
+    std::vector<std::string> words;
+    for (int i = 0; i < 300; ++i) {
+        std::string w = heads[rng() % heads.size()];
+        for (int k = rng() % 4; k > 0; --k) w += tails[rng() % tails.size()];
+        words.push_back(w);
+    }
+    for (int i = 0; i < 200; ++i) {
+        std::string w;
+        for (int k = 1 + rng() % 12; k > 0; --k) w += (char)('a' + rng() % 26);
+        words.push_back(w);
+    }
+    for (int i = 0; i < 200; ++i) {
+        const std::string& t = tails[rng() % tails.size()];
+        if (t.size() > 1) words.push_back(heads[rng() % heads.size()] + t.substr(0, 1 + rng() % (t.size() - 1)));
+    }
+    for (size_t n : {max_chars - 1, max_chars, max_chars + 1, max_chars + 20}) {
+        std::string w = heads[rng() % heads.size()];
+        while (w.size() < n) w += tails[rng() % tails.size()];
+        words.push_back(w.substr(0, n));
+    }
+
+    // 过长或无法切分的词为 unk，词表没有 unk 时不产生 id
+    std::vector<int> unk_ids;
+    if (unk != -1) unk_ids.push_back(unk);
+    for (const std::string& w : words) {
+        std::vector<int> expected;
+        if (w.size() > max_chars) {
+            expected = unk_ids;
+        } else {
+            for (size_t start = 0; start < w.size();) {
+                size_t end = w.size();
+                int id = -1;
+                for (; end > start; --end) {
+                    auto it = ids.find((start > 0 ? prefix : "") + w.substr(start, end - start));
+                    if (it != ids.end()) { id = it->second; break; }
+                }
+                if (id == -1) { expected = unk_ids; break; }
+                expected.push_back(id);
+                start = end;
+            }
+        }
+        std::vector<int> result = tok->encode(w, false);
+        if (result != expected) {
+            if (verbose) {
+                std::cout << std::endl << Color::RED << "     ├── Greedy Mismatch ❌ " << Color::RESET << "#" << w << "#" << std::endl;
+                std::cout << Color::GREY << "     │ Expected: ";
+                for (int id : expected) std::cout << id << " ";
+                std::cout << std::endl << "     │ Got:      ";
+                for (int id : result) std::cout << id << " ";
+                std::cout << Color::RESET << std::endl;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
 // 运行单个模型的所有测试
 TestResult run_model_tests(const std::string& model_path, const std::string& model_name, bool verbose = false) {
     TestResult result;
@@ -293,6 +404,23 @@ TestResult run_model_tests(const std::string& model_path, const std::string& mod
     }
     g_total_load_ms += std::chrono::duration<double, std::milli>(end - start).count();
 
+    // WordPiece 模型额外与贪心最长匹配参照实现比较
+    std::ifstream tf(model_path + "/tokenizer.json");
+    std::stringstream ts;
+    ts << tf.rdbuf();
+    json config = json::parse(ts.str());
+    if (config.contains("model") && config["model"].value("type", "") == "WordPiece") {
+        std::cout << "  ├─ " << std::left << std::setw(8) << "[match]";
+        print_aligned("WordPiece longest-match reference", 45);
+        if (run_wordpiece_test(tok.get(), config["model"], verbose)) {
+            std::cout << Color::GREEN << "[PASS]" << Color::RESET << std::endl;
+            result.passed++;
+        } else {
+            std::cout << Color::RED << "[FAIL]" << Color::RESET << std::endl;
+            result.failed++;
+        }
+    }
+
     // 2. 加载 test_cases.jsonl
     std::string cases_path = model_path + "/test_cases.jsonl";
     std::ifstream f(cases_path);
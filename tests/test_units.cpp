@@ -0,0 +1,1299 @@
+/**
+ * test_units.cpp - 组件单元测试
+ *
+ * 直接包含 src/tokenizer.cpp，在合成的小词表上把各个加速实现 (词缓存、回溯 BPE、并行编码、
+ * 正则 DFA、WordPiece 融合路径等) 与参照实现逐一对比，不依赖 tests/models 下的模型文件。
+ *
+ * 用法: ./test_units
+ */
+
+#include "../src/tokenizer.cpp"
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace tokenizer;
+
+// ==================== 断言与统计 ====================
+
+static int g_passed = 0;
+static int g_failed = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (ok) { g_passed++; return; }
+    g_failed++;
+    std::cout << "  \033[31m[FAIL]\033[0m " << what << std::endl;
+}
+
+static std::string quote(const std::string& s) { return json(s).dump(); }
+
+// 可打印 ASCII 原样输出，其余字节写成 \xHH (可用于非法 UTF-8)
+static std::string escape_bytes(const std::string& s) {
+    std::string out;
+    for (unsigned char c : s) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), c >= 0x20 && c < 0x7F ? "%c" : "\\x%02X", c);
+        out += buf;
+    }
+    return out;
+}
+
+// ==================== 合成词表 ====================
+
+// 带数字、多字节字符与 emoji 的随机语料，按空格分词
+static std::vector<std::string> make_corpus(size_t words, unsigned seed) {
+    static const char* pieces[] = {"a", "b", "c", "e", "n", "r", "s", "t", "th", "er", "in", "0", "1", "7",
+                                   "\xC3\xA9", "\xE4\xB8\xAD", "\xE6\x96\x87", "\xF0\x9F\x98\x8A", "-", "."};
+    std::mt19937 rng(seed);
+    std::vector<std::string> out;
+    for (size_t i = 0; i < words; ++i) {
+        std::string w;
+        size_t n = 1 + rng() % 8;
+        for (size_t k = 0; k < n; ++k) w += pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+        out.push_back(w);
+    }
+    return out;
+}
+
+// 字节级 BPE: 256 个 GPT-2 字节符号，再按频次在 words 上学 n_merges 次合并 (同频取字典序最小)
+struct ToyBPE {
+    std::vector<std::string> vocab;
+    std::vector<std::pair<std::string, std::string>> merges;
+};
+
+static ToyBPE train_bpe(const std::vector<std::string>& words, int n_merges) {
+    std::vector<std::string> byte_map = create_bytes_char_map();
+    ToyBPE bpe;
+    bpe.vocab = byte_map;
+    std::vector<std::vector<std::string>> split;
+    for (const auto& w : words) {
+        std::vector<std::string> syms;
+        for (unsigned char b : w) syms.push_back(byte_map[b]);
+        split.push_back(syms);
+    }
+    for (int m = 0; m < n_merges; ++m) {
+        std::map<std::pair<std::string, std::string>, int> counts;
+        for (const auto& syms : split) {
+            for (size_t i = 0; i + 1 < syms.size(); ++i) counts[std::make_pair(syms[i], syms[i + 1])]++;
+        }
+        if (counts.empty()) break;
+        auto best = counts.begin();
+        for (auto it = counts.begin(); it != counts.end(); ++it) {
+            if (it->second > best->second) best = it;
+        }
+        std::pair<std::string, std::string> pair = best->first;
+        bpe.merges.push_back(pair);
+        bpe.vocab.push_back(pair.first + pair.second);
+        for (auto& syms : split) {
+            std::vector<std::string> next;
+            for (size_t i = 0; i < syms.size(); ++i) {
+                if (i + 1 < syms.size() && syms[i] == pair.first && syms[i + 1] == pair.second) {
+                    next.push_back(pair.first + pair.second);
+                    ++i;
+                } else {
+                    next.push_back(syms[i]);
+                }
+            }
+            syms.swap(next);
+        }
+    }
+    return bpe;
+}
+
+// GPT-2 风格的 tokenizer.json: ByteLevel 预分词 + 字节级 BPE
+static std::string bpe_json(const ToyBPE& bpe) {
+    std::string vocab, merges;
+    for (size_t i = 0; i < bpe.vocab.size(); ++i) vocab += (i ? "," : "") + quote(bpe.vocab[i]) + ":" + std::to_string(i);
+    for (size_t i = 0; i < bpe.merges.size(); ++i) merges += (i ? "," : "") + quote(bpe.merges[i].first + " " + bpe.merges[i].second);
+    return "{\"model\":{\"type\":\"BPE\",\"vocab\":{" + vocab + "},\"merges\":[" + merges + "]},"
+           "\"pre_tokenizer\":{\"type\":\"ByteLevel\",\"add_prefix_space\":false,\"use_regex\":true},"
+           "\"decoder\":{\"type\":\"ByteLevel\"}}";
+}
+
+static const ToyBPE& toy_bpe() {
+    static ToyBPE bpe = train_bpe(make_corpus(3000, 1), 300);
+    return bpe;
+}
+
+// 直接以原始字节为输入的 BPEModel (不经过预分词)，关闭词缓存
+static std::shared_ptr<BPEModel> toy_model(const ToyBPE& bpe) {
+    std::map<std::string, int> vocab;
+    std::map<std::pair<int, int>, int> merges;
+    for (size_t i = 0; i < bpe.vocab.size(); ++i) vocab[bpe.vocab[i]] = (int)i;
+    for (size_t i = 0; i < bpe.merges.size(); ++i) merges[std::make_pair(vocab[bpe.merges[i].first], vocab[bpe.merges[i].second])] = (int)i;
+    auto model = std::make_shared<BPEModel>(vocab, merges, std::map<std::string, int>(), true, false);
+    model->set_cache_capacity(0, 0);
+    return model;
+}
+
+// 参照实现: 每轮在整个序列上找秩最小 (同秩取最左) 的相邻对合并，直到没有可合并的对
+static std::vector<int> naive_bpe(const ToyBPE& bpe, const std::string& text) {
+    static std::map<std::string, int> vocab;
+    static std::map<std::pair<int, int>, int> rank;
+    if (vocab.empty()) {
+        for (size_t i = 0; i < bpe.vocab.size(); ++i) vocab[bpe.vocab[i]] = (int)i;
+        for (size_t i = 0; i < bpe.merges.size(); ++i) rank[std::make_pair(vocab[bpe.merges[i].first], vocab[bpe.merges[i].second])] = (int)i;
+    }
+    std::vector<int> ids;
+    for (unsigned char b : text) ids.push_back(vocab[bpe.vocab[b]]);
+    for (;;) {
+        int best = -1, best_rank = INT_MAX;
+        for (size_t i = 0; i + 1 < ids.size(); ++i) {
+            auto it = rank.find(std::make_pair(ids[i], ids[i + 1]));
+            if (it != rank.end() && it->second < best_rank) { best_rank = it->second; best = (int)i; }
+        }
+        if (best < 0) return ids;
+        ids[best] = vocab[bpe.vocab[ids[best]] + bpe.vocab[ids[best + 1]]];
+        ids.erase(ids.begin() + best + 1);
+    }
+}
+
+// 回溯编码器的对抗输入: 随机拼接的词表 token、单字符与双字符重复、随机字节 (含非法 UTF-8)
+// 以 GPT-2 字节符号书写的 token 所代表的原始字节
+static std::string raw_bytes(const std::string& symbols) {
+    static std::map<std::string, unsigned char> byte_of;
+    if (byte_of.empty()) {
+        std::vector<std::string> byte_map = create_bytes_char_map();
+        for (int b = 0; b < 256; ++b) byte_of[byte_map[b]] = (unsigned char)b;
+    }
+    std::string out;
+    for (size_t i = 0; i < symbols.size();) {
+        int32_t cp;
+        ssize_t r = utf8proc_iterate((const uint8_t*)symbols.data() + i, symbols.size() - i, &cp);
+        out += (char)byte_of[symbols.substr(i, r)];
+        i += r;
+    }
+    return out;
+}
+
+static std::vector<std::string> adversarial_inputs(const ToyBPE& bpe, size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<std::string> out;
+    for (size_t i = 0; i < n; ++i) {
+        std::string s;
+        size_t len = 1 + rng() % 200;
+        switch (i % 4) {
+        case 0: while (s.size() < len) s += raw_bytes(bpe.vocab[rng() % bpe.vocab.size()]); break;
+        case 1: s.assign(len, "aet"[rng() % 3]); break;
+        case 2: { std::string unit = raw_bytes(bpe.vocab[256 + rng() % (bpe.vocab.size() - 256)]); while (s.size() < len) s += unit; } break;
+        default: for (size_t k = 0; k < len; ++k) s += (char)(rng() % 256); break;
+        }
+        out.push_back(s);
+    }
+    return out;
+}
+
+// ==================== 切分差分 ====================
+
+typedef std::vector<std::pair<int, int>> MatchList;
+
+// for_each_match 的结果: matcher 为空时即 Oniguruma 的切分
+static MatchList split_matches(const tokenizer::OnigRegex& regex, const SplitMatcher* matcher, const std::string& text) {
+    MatchList out;
+    for_each_match(regex, matcher, text.data(), text.size(), [&](int b, int e) { out.push_back(std::make_pair(b, e)); });
+    return out;
+}
+
+static std::vector<std::string> random_texts(const std::vector<std::string>& pieces, size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<std::string> out(pieces);
+    for (size_t i = 0; i < n; ++i) {
+        std::string t;
+        for (int k = 1 + rng() % 12; k > 0; --k) t += pieces[rng() % pieces.size()];
+        out.push_back(t);
+    }
+    return out;
+}
+
+// matcher 与 Oniguruma 切分不同的文本数，第一个不同的文本写入 example
+static int split_mismatches(const std::string& pattern, const SplitMatcher& matcher, const std::vector<std::string>& texts, std::string& example) {
+    tokenizer::OnigRegex regex(pattern);
+    int n = 0;
+    for (const auto& t : texts) {
+        if (split_matches(regex, &matcher, t) == split_matches(regex, nullptr, t)) continue;
+        if (n++ == 0) example = t;
+    }
+    return n;
+}
+
+// ==================== 测试用例 ====================
+
+static void test_model_memory_usage() {
+    PreTrainedTokenizer tok;
+    check(tok.model_memory_usage() == 0, "model_memory_usage: no model loaded");
+    check(tok.load_from_json_str(bpe_json(toy_bpe())), "model_memory_usage: load toy BPE");
+    check(tok.model_memory_usage() > 0, "model_memory_usage: BPE lookup tables are counted");
+}
+
+// 长度超过 16 字节的随机小写单词，确保走词缓存而不是栈上合并
+static std::vector<std::string> long_words(size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<std::string> out;
+    for (size_t i = 0; i < n; ++i) {
+        std::string w;
+        size_t len = 20 + rng() % 20;
+        for (size_t k = 0; k < len; ++k) w += (char)('a' + rng() % 26);
+        out.push_back(w);
+    }
+    return out;
+}
+
+static void test_word_cache() {
+    std::vector<int> ids;
+    WordCache entries(8, 0);
+    for (int i = 0; i < 20; ++i) entries.put("key" + std::to_string(i), std::vector<int>(3, i));
+    CacheStats st = entries.stats();
+    check(st.entries == 8 && st.evictions == 12 && st.bytes > 0, "word cache: entry budget evicts down to 8 entries");
+    ids.clear();
+    check(entries.get("key19", ids) && ids == std::vector<int>(3, 19), "word cache: newest entry is kept");
+    check(!entries.get("key0", ids), "word cache: oldest entry is evicted");
+    st = entries.stats();
+    check(st.hits == 1 && st.misses == 1, "word cache: hit and miss counters");
+
+    entries.clear();
+    st = entries.stats();
+    check(st.entries == 0 && st.bytes == 0 && st.hits == 1, "word cache: clear drops entries and bytes, keeps counters");
+
+    // A hit sets the reference bit, so the hand passes over that entry and evicts a cold one
+    WordCache clock(4, 0);
+    for (int i = 0; i < 5; ++i) clock.put("k" + std::to_string(i), std::vector<int>(1, i));
+    check(clock.get("k1", ids), "word cache: k1 present before second eviction");
+    clock.put("k5", std::vector<int>(1, 5));
+    check(clock.get("k1", ids), "word cache: recently hit entry survives eviction");
+    check(clock.stats().entries == 4, "word cache: size stays at budget");
+
+    WordCache bytes(1000, 2000);
+    for (int i = 0; i < 200; ++i) bytes.put("word" + std::to_string(i), std::vector<int>(10, i));
+    st = bytes.stats();
+    check(st.bytes <= 2000 && st.evictions > 0 && st.entries > 0, "word cache: byte budget is enforced");
+    bytes.put("huge", std::vector<int>(1000, 1));
+    check(!bytes.get("huge", ids), "word cache: entry larger than the byte budget is not stored");
+
+    // Resharding while other threads read and write: no lookup may return another key's ids
+    WordCache shared(100, 0);
+    std::atomic<bool> stop(false), wrong(false);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t) {
+        workers.emplace_back([&, t]() {
+            std::vector<int> got;
+            for (int i = 0; !stop.load(); ++i) {
+                std::string key = "w" + std::to_string((i * 7 + t) % 5000);
+                std::vector<int> want(1, (int)std::hash<std::string>()(key));
+                shared.put(key, want);
+                got.clear();
+                if (shared.get(key, got) && got != want) wrong = true;
+            }
+        });
+    }
+    for (int r = 0; r < 200; ++r) shared.set_capacity(r % 2 ? 100000 : 100, 0);
+    stop = true;
+    for (auto& w : workers) w.join();
+    check(!wrong.load(), "word cache: set_capacity during concurrent get/put keeps entries consistent");
+    shared.set_capacity(100000, 0);
+    shared.put("after", std::vector<int>(1, 7));
+    check(shared.get("after", ids), "word cache: entries are found after resharding");
+}
+
+static void test_cache_api() {
+    PreTrainedTokenizer tok;
+    tok.load_from_json_str(bpe_json(toy_bpe()));
+    std::vector<std::string> words = long_words(40, 2);
+
+    tok.set_cache_capacity(4);
+    for (const auto& w : words) tok.encode(w, false);
+    CacheStats st = tok.cache_stats();
+    check(st.entries == 4 && st.evictions >= 36 && st.misses >= 40, "cache api: entry budget and eviction counter");
+    std::vector<int> first = tok.encode(words.back(), false);
+    check(tok.cache_stats().hits == st.hits + 1, "cache api: repeated word is a hit");
+
+    tok.set_cache_capacity(1000, 3000);
+    for (const auto& w : words) tok.encode(w, false);
+    st = tok.cache_stats();
+    check(st.bytes > 0 && st.bytes <= 3000, "cache api: byte budget is enforced");
+
+    tok.clear_cache();
+    st = tok.cache_stats();
+    check(st.entries == 0 && st.bytes == 0, "cache api: clear_cache resets entries and bytes");
+
+    tok.set_cache_capacity(0);
+    std::vector<int> again = tok.encode(words.back(), false);
+    check(tok.cache_stats().entries == 0 && again == first, "cache api: capacity 0 disables caching, same ids");
+}
+
+static void test_backtracking_matches_merge() {
+    const ToyBPE& bpe = toy_bpe();
+    auto model = toy_model(bpe);
+    int mismatches = 0;
+    for (const auto& text : adversarial_inputs(bpe, 2000, 3)) {
+        if (model->tokenize(text) != naive_bpe(bpe, text)) mismatches++;
+    }
+    for (const auto& word : make_corpus(2000, 4)) {
+        if (model->tokenize(word) != naive_bpe(bpe, word)) mismatches++;
+    }
+    check(mismatches == 0, "backtracking BPE equals the lowest-rank-first merge (" + std::to_string(mismatches) + " mismatches)");
+}
+
+// tiktoken 转换来的词表: merges 按 id 依次列出每个 token 拆成两个词表项的全部方式，秩由词表推出，
+// 不建合并表。编码结果与同一组合并显式建表、与参照实现一致；无法拆成两个词表项的 token 只能由字节组成
+static void test_vocab_ranks() {
+    ToyBPE bpe;
+    bpe.vocab = toy_bpe().vocab;
+    std::vector<std::string> byte_map = create_bytes_char_map();
+    std::string orphan = byte_map[1] + byte_map[2] + byte_map[3]; // 前后缀都不成词
+    bpe.vocab.push_back(orphan);
+    std::map<std::string, int> vocab;
+    for (size_t i = 0; i < bpe.vocab.size(); ++i) vocab[bpe.vocab[i]] = (int)i;
+    for (const auto& t : bpe.vocab) {
+        std::vector<std::pair<int, std::string>> splits;
+        for (size_t k = 1; k < t.size(); ++k) {
+            if (((unsigned char)t[k] & 0xC0) == 0x80) continue;
+            if (vocab.count(t.substr(0, k)) && vocab.count(t.substr(k))) splits.push_back(std::make_pair(vocab[t.substr(0, k)], t.substr(k)));
+        }
+        std::sort(splits.begin(), splits.end());
+        for (const auto& s : splits) bpe.merges.push_back(std::make_pair(bpe.vocab[s.first], s.second));
+    }
+
+    json vocab_json = json::object(), merges_json = json::array();
+    for (size_t i = 0; i < bpe.vocab.size(); ++i) vocab_json[bpe.vocab[i]] = (int)i;
+    for (const auto& m : bpe.merges) merges_json.push_back(m.first + " " + m.second);
+    BPEModel derived(true, false);
+    derived.load(vocab_json, merges_json);
+    derived.set_cache_capacity(0, 0);
+    check(derived.vocab_ranks_, "merges listing every split in id order take their ranks from the vocab");
+    auto explicit_table = toy_model(bpe);
+    check(!explicit_table->vocab_ranks_, "merges given as a map build a merge table");
+
+    // 少一个拆分时数目对不上，退回合并表
+    json partial = json::array();
+    for (size_t i = 0; i < bpe.merges.size(); ++i) {
+        if (i != bpe.merges.size() / 2) partial.push_back(bpe.merges[i].first + " " + bpe.merges[i].second);
+    }
+    BPEModel fallback(true, false);
+    fallback.load(vocab_json, partial);
+    check(!fallback.vocab_ranks_, "merges missing a split fall back to a merge table");
+
+    std::map<std::pair<int, int>, int> rank;
+    for (size_t i = 0; i < bpe.merges.size(); ++i) rank[std::make_pair(vocab[bpe.merges[i].first], vocab[bpe.merges[i].second])] = (int)i;
+    auto reference = [&](const std::string& text) {
+        std::vector<int> ids;
+        for (unsigned char b : text) ids.push_back(vocab[byte_map[b]]);
+        for (;;) {
+            int best = -1, best_rank = INT_MAX;
+            for (size_t i = 0; i + 1 < ids.size(); ++i) {
+                auto it = rank.find(std::make_pair(ids[i], ids[i + 1]));
+                if (it != rank.end() && it->second < best_rank) { best_rank = it->second; best = (int)i; }
+            }
+            if (best < 0) return ids;
+            ids[best] = vocab[bpe.vocab[ids[best]] + bpe.vocab[ids[best + 1]]];
+            ids.erase(ids.begin() + best + 1);
+        }
+    };
+    std::vector<std::string> texts = adversarial_inputs(bpe, 1500, 15);
+    for (const auto& w : make_corpus(1000, 16)) texts.push_back(w);
+    texts.push_back(raw_bytes(orphan));
+    texts.push_back("a" + raw_bytes(orphan) + raw_bytes(orphan) + "b");
+    int bad_derived = 0, bad_table = 0;
+    for (const auto& t : texts) {
+        std::vector<int> expected = reference(t);
+        if (derived.tokenize(t) != expected) bad_derived++;
+        if (explicit_table->tokenize(t) != expected) bad_table++;
+    }
+    check(bad_derived == 0, "vocab-derived ranks encode like the lowest-rank-first reference (" + std::to_string(bad_derived) + " mismatches)");
+    check(bad_table == 0, "the explicit merge table encodes like the reference (" + std::to_string(bad_table) + " mismatches)");
+    std::vector<int> bytes = {vocab[byte_map[1]], vocab[byte_map[2]], vocab[byte_map[3]]};
+    check(derived.tokenize(raw_bytes(orphan)) == bytes && explicit_table->tokenize(raw_bytes(orphan)) == bytes,
+          "a vocab entry with no split into two entries is never produced");
+}
+
+// 单个超长预分词 (无空白的字母串、数字串) 切段并行编码，多字节字符会落在切点附近
+static void test_parallel_encode() {
+    PreTrainedTokenizer serial, parallel;
+    serial.load_from_json_str(bpe_json(toy_bpe()));
+    parallel.load_from_json_str(bpe_json(toy_bpe()));
+    serial.set_cache_capacity(0);
+    parallel.set_cache_capacity(0);
+    parallel.set_parallel_encode(4, 1);
+
+    const char* letters[] = {"a", "b", "c", "e", "n", "r", "s", "t", "th", "er", "in", "\xC3\xA9", "\xE4\xB8\xAD", "\xE6\x96\x87"};
+    std::mt19937 rng(5);
+    std::vector<std::string> inputs;
+    for (size_t size : {40000u, 70001u, 200000u}) {
+        std::string word, digits, mixed;
+        while (word.size() < size) word += letters[rng() % 14];
+        while (digits.size() < size) digits += (char)('0' + rng() % 10);
+        while (mixed.size() < size) mixed += rng() % 50 ? std::string(letters[rng() % 14]) : std::string(" ");
+        inputs.push_back(word);
+        inputs.push_back(digits);
+        inputs.push_back(mixed);
+    }
+    inputs.push_back(std::string(100000, 'a'));
+    std::string han;
+    while (han.size() < 100000) han += "\xE4\xB8\xAD";
+    inputs.push_back(han);
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        check(parallel.encode(inputs[i], false) == serial.encode(inputs[i], false),
+              "parallel encode equals serial encode, input " + std::to_string(i) + " (" + std::to_string(inputs[i].size()) + " bytes)");
+    }
+}
+
+// 双数组 trie 与 std::map 对比: 随机字节键 (含 0x00/0xFF、共享前缀、空键、重复键以后者为准)，
+// 逐字节走查的公共前缀搜索、find 与子结点枚举都一致
+static void test_double_array_trie() {
+    std::mt19937 rng(18);
+    int bad_prefix = 0, bad_find = 0, bad_children = 0;
+    for (int round = 0; round < 30; ++round) {
+        const int alphabet = round % 3 == 0 ? 256 : 2 + round % 7;
+        auto random_key = [&](size_t max) {
+            std::string k;
+            for (size_t n = rng() % (max + 1); n > 0; --n) k += (char)(round % 3 == 0 ? rng() % 256 : 'a' + rng() % alphabet);
+            return k;
+        };
+        std::vector<std::pair<std::string, int>> keys;
+        std::map<std::string, int> ref;
+        for (int i = 0, n = 1 + rng() % (round < 20 ? 300 : 5000); i < n; ++i) {
+            // 一部分键是已有键的延长，另有重复键
+            std::string k = !keys.empty() && rng() % 3 == 0 ? keys[rng() % keys.size()].first + random_key(3) : random_key(12);
+            keys.push_back(std::make_pair(k, (int)(rng() % 100000)));
+            ref[k] = keys.back().second;
+        }
+        DoubleArrayTrie trie;
+        trie.build(keys);
+
+        std::vector<std::string> queries;
+        for (const auto& k : keys) queries.push_back(k.first + random_key(2));
+        for (int i = 0; i < 500; ++i) queries.push_back(random_key(16));
+        for (const auto& q : queries) {
+            std::vector<std::pair<size_t, int>> got, expected;
+            int node = 0;
+            if (trie.value(node) >= 0) got.push_back(std::make_pair((size_t)0, trie.value(node)));
+            for (size_t i = 0; i < q.size() && trie.next(node, (unsigned char)q[i]); ++i) {
+                if (trie.value(node) >= 0) got.push_back(std::make_pair(i + 1, trie.value(node)));
+            }
+            for (size_t len = 0; len <= q.size(); ++len) {
+                auto it = ref.find(q.substr(0, len));
+                if (it != ref.end()) expected.push_back(std::make_pair(len, it->second));
+            }
+            if (got != expected) bad_prefix++;
+            auto it = ref.find(q);
+            if (trie.find(q.data(), q.size()) != (it == ref.end() ? -1 : it->second)) bad_find++;
+        }
+
+        // 每个键的结点的子结点 = map 中以该键加一个字节开头的键的那个字节
+        for (const auto& k : ref) {
+            int node = 0;
+            for (unsigned char c : k.first) trie.next(node, c);
+            std::set<unsigned char> got, expected;
+            trie.for_each_child(node, [&](unsigned char c, int) { got.insert(c); });
+            for (auto it = ref.upper_bound(k.first); it != ref.end() && it->first.compare(0, k.first.size(), k.first) == 0; ++it) {
+                expected.insert((unsigned char)it->first[k.first.size()]);
+            }
+            if (got != expected) bad_children++;
+        }
+    }
+    check(bad_prefix == 0, "double-array common-prefix search equals std::map (" + std::to_string(bad_prefix) + " mismatches)");
+    check(bad_find == 0, "double-array find equals std::map (" + std::to_string(bad_find) + " mismatches)");
+    check(bad_children == 0, "double-array children equal the next bytes of longer keys (" + std::to_string(bad_children) + " mismatches)");
+}
+
+// utf8proc_map 参照结果; 非法 UTF-8 时返回 false (规范化器应原样保留文本)
+static bool utf8proc_reference(const std::string& text, bool compose, std::string& out) {
+    utf8proc_uint8_t* buf = nullptr;
+    utf8proc_ssize_t n = utf8proc_map((const utf8proc_uint8_t*)text.c_str(), 0, &buf,
+        (utf8proc_option_t)(UTF8PROC_NULLTERM | UTF8PROC_STABLE | UTF8PROC_COMPAT | (compose ? UTF8PROC_COMPOSE : UTF8PROC_DECOMPOSE)));
+    if (n < 0) return false;
+    out.assign((const char*)buf, (size_t)n);
+    free(buf);
+    return true;
+}
+
+static void test_nfkc() {
+    const char* pieces[] = {
+        "a", "Z", " ", "e\xCC\x81", "\xC3\xA9", "a\xCC\x88\xCC\x81", "a\xCC\x81\xCC\xA3", "\xCC\x81",
+        "\xED\x95\x9C", "\xEA\xB5\xAD", "\xEC\x96\xB4",             // 한 국 어
+        "\xE1\x84\x80", "\xE1\x85\xA1", "\xE1\x86\xA8",             // 初声 ᄀ, 中声 ᅡ, 终声 ᆨ
+        "\xEA\xB0\x80",                                             // 가 (LV，可与终声组合)
+        "\xEF\xAC\x81", "\xE2\x91\xA0", "\xEF\xBC\xA1", "\xEF\xBD\xB6", "\xEF\xBE\x9E", // ﬁ ① Ａ ｶ ﾞ
+        "\xE2\x84\xAB", "\xE4\xB8\xAD", "\xF0\x9F\x98\x8A",         // Å(埃) 中 😊
+    };
+    const size_t n_pieces = sizeof(pieces) / sizeof(pieces[0]);
+    std::mt19937 rng(6);
+    std::vector<std::string> texts(pieces, pieces + n_pieces);
+    for (int i = 0; i < 3000; ++i) {
+        std::string t;
+        for (int k = 1 + rng() % 12; k > 0; --k) t += pieces[rng() % n_pieces];
+        texts.push_back(t);
+    }
+
+    for (bool compose : {true, false}) {
+        NFKCNormalizer norm(compose);
+        std::string form = compose ? "NFKC" : "NFKD";
+        int mismatches = 0;
+        for (const auto& t : texts) {
+            std::string expected, out;
+            std::vector<Offset> align;
+            utf8proc_reference(t, compose, expected);
+            bool changed = norm.normalize_into(t, out);
+            if ((changed ? out : t) != expected) mismatches++;
+            changed = norm.normalize_aligned(t, out, align);
+            if ((changed ? out : t) != expected || (changed && align.size() != out.size())) mismatches++;
+        }
+        check(mismatches == 0, form + " equals utf8proc on Hangul, jamo, combining and compatibility text (" + std::to_string(mismatches) + " mismatches)");
+
+        // 非法字节出现在需要规范化的字符之前、之中或之后: 原样返回且不写 out/align
+        const char* invalid[] = {
+            "abc\xFF", "\xFF" "e\xCC\x81", "e\xCC\x81\xFF", "\xEF\xAC\x81 x \xC3", "\xE1\x84\x80\xE1\x85\xA1\xE4\xB8",
+            "\xED\x95\x9C\xED\xA0\x80", "\xEF\xBD\xB6\x80\xEF\xBE\x9E", "\xC0\xAF\xCC\x81",
+        };
+        for (const char* t : invalid) {
+            std::string expected;
+            check(!utf8proc_reference(t, compose, expected), form + " reference rejects " + escape_bytes(t));
+            std::string out = "sentinel";
+            std::vector<Offset> align(3, Offset(7, 7));
+            bool changed = norm.normalize_into(t, out);
+            check(!changed && out == "sentinel", form + " leaves invalid UTF-8 unchanged: " + escape_bytes(t));
+            changed = norm.normalize_aligned(t, out, align);
+            check(!changed && out == "sentinel" && align.size() == 3 && align[0] == Offset(7, 7),
+                  form + " does not touch out/align on invalid UTF-8: " + escape_bytes(t));
+        }
+    }
+}
+
+// Replace 规则逐条执行的参照: 每条规则从左到右替换互不重叠的出现
+static std::string replace_chain(const std::vector<MultiReplacer::Rule>& rules, std::string text) {
+    for (const auto& r : rules) {
+        std::string out;
+        size_t pos = 0;
+        for (size_t hit; !r.first.empty() && (hit = text.find(r.first, pos)) != std::string::npos; pos = hit + r.first.size()) {
+            out.append(text, pos, hit - pos);
+            out += r.second;
+        }
+        out.append(text, pos, std::string::npos);
+        text.swap(out);
+    }
+    return text;
+}
+
+// 相邻的 Replace 只在 can_fuse 成立时合成一个 MultiReplacer: 可合并时一趟的结果等于逐条执行，
+// 重叠、包含、前一条的输出喂给后一条、替换为空串的链必须拒绝；加载器对 Sequence 规范化器与解码器
+// 的合并不改变结果
+static void test_replace_fusion() {
+    typedef std::vector<MultiReplacer::Rule> Rules;
+    struct { Rules rules; bool fuse; } cases[] = {
+        {{{"a", "x"}, {"b", "y"}}, true},
+        {{{"ab", "x"}, {"cd", "y"}, {"e", "zz"}}, true},
+        {{{"ab", "x"}, {"bc", "y"}}, false},        // 重叠: abc
+        {{{"a", "x"}, {"ab", "y"}}, false},         // 包含
+        {{{"a", "b"}, {"b", "c"}}, false},          // a -> b -> c
+        {{{"a", "bx"}, {"xb", "c"}}, false},        // 替换结果与后一条的模式共享字节
+        {{{"a", ""}, {"bb", "c"}}, false},          // 删除 a 会拼出新的 bb
+        {{{"", "x"}, {"b", "y"}}, false},
+    };
+    for (const auto& c : cases) {
+        std::string desc;
+        for (const auto& r : c.rules) desc += " " + r.first + "->" + r.second;
+        check(MultiReplacer::can_fuse(c.rules) == c.fuse, std::string("can_fuse ") + (c.fuse ? "accepts" : "rejects") + desc);
+    }
+
+    // 随机规则链: 能合并的链一趟执行等于逐条执行；每条单独成链时 (自身重叠如 aa/aaa) 也相等
+    std::mt19937 rng(14);
+    auto word = [&](const char* alphabet, size_t max) {
+        std::string w;
+        for (size_t n = rng() % (max + 1); n > 0; --n) w += alphabet[rng() % strlen(alphabet)];
+        return w;
+    };
+    std::vector<std::string> texts;
+    for (int i = 0; i < 100; ++i) texts.push_back(word("abcxy", 14));
+    int fused = 0, bad_fused = 0, bad_single = 0, missed = 0;
+    for (int i = 0; i < 1000; ++i) {
+        Rules rules;
+        for (int k = 2 + rng() % 2; k > 0; --k) {
+            std::string p = word("abc", 3);
+            if (p.empty()) p = "a";
+            rules.push_back(MultiReplacer::Rule(p, word("abcxy", 2)));
+        }
+        bool can = MultiReplacer::can_fuse(rules);
+        fused += can;
+        MultiReplacer all(rules);
+        for (const auto& t : texts) {
+            std::string expected = replace_chain(rules, t), out;
+            bool changed = all.apply(t, out);
+            bool same = (changed ? out : t) == expected;
+            if (can && !same) bad_fused++;
+            if (!can && !same) missed++;
+            Rules one(1, rules[0]);
+            out.clear();
+            changed = MultiReplacer(one).apply(t, out);
+            if ((changed ? out : t) != replace_chain(one, t)) bad_single++;
+        }
+    }
+    check(fused > 30 && fused < 970, "random Replace chains include both fusable and unfusable ones (" + std::to_string(fused) + " fusable)");
+    check(bad_fused == 0, "fused Replace rules equal the passes one by one (" + std::to_string(bad_fused) + " mismatches)");
+    check(bad_single == 0, "a single Replace rule replaces non-overlapping matches left to right (" + std::to_string(bad_single) + " mismatches)");
+    check(missed > 0, "some rejected chains would differ if fused (" + std::to_string(missed) + " texts)");
+
+    // 加载器: Sequence 里相邻的 Replace 规范化器与解码器，合并与否结果都等于逐条执行
+    std::string vocab = "[[\"<unk>\",0]";
+    const char* chars[] = {"a", "b", "c", "x", "y", "ab", "bc", "xa"};
+    for (const char* c : chars) vocab += std::string(",[\"") + c + "\",-1]";
+    vocab += "]";
+    int bad_norm = 0, bad_dec = 0;
+    for (const auto& c : cases) {
+        if (c.rules[0].first.empty()) continue;
+        std::string steps;
+        for (const auto& r : c.rules) {
+            steps += std::string(steps.empty() ? "" : ",") + "{\"type\":\"Replace\",\"pattern\":{\"String\":" + quote(r.first) + "},\"content\":" + quote(r.second) + "}";
+        }
+        PreTrainedTokenizer norm, dec;
+        norm.load_from_json_str("{\"normalizer\":{\"type\":\"Sequence\",\"normalizers\":[" + steps + "]},"
+                                "\"model\":{\"type\":\"Unigram\",\"unk_id\":0,\"vocab\":[[\"<unk>\",0],[\"a\",-1],[\"b\",-1],[\"c\",-1],[\"x\",-1],[\"y\",-1],[\"z\",-1],[\"e\",-1],[\"d\",-1]]}}");
+        dec.load_from_json_str("{\"decoder\":{\"type\":\"Sequence\",\"decoders\":[" + steps + "]},"
+                               "\"model\":{\"type\":\"Unigram\",\"unk_id\":0,\"vocab\":" + vocab + "}}");
+        for (const auto& t : texts) {
+            std::vector<int> expected;
+            for (char ch : replace_chain(c.rules, t)) expected.push_back(norm.token_to_id(std::string(1, ch)));
+            if (norm.encode(t, false) != expected) bad_norm++;
+        }
+        for (int i = 0; i < 200; ++i) {
+            std::vector<int> ids;
+            std::string expected;
+            for (int k = rng() % 6; k > 0; --k) {
+                ids.push_back(1 + rng() % 8);
+                expected += replace_chain(c.rules, dec.id_to_token(ids.back()));
+            }
+            if (dec.decode(ids) != expected) bad_dec++;
+        }
+    }
+    check(bad_norm == 0, "Sequence of Replace normalizers equals the passes one by one (" + std::to_string(bad_norm) + " mismatches)");
+    check(bad_dec == 0, "Sequence of Replace decoders equals the passes one by one per token (" + std::to_string(bad_dec) + " mismatches)");
+}
+
+// 按 darts-clone 的单元布局把 源串 -> 替换串 编成 Precompiled 的 base64 charsmap:
+// u32 双数组大小、双数组、以 NUL 结尾的替换串池
+static std::string precompiled_charsmap(const std::map<std::string, std::string>& rules) {
+    struct Node { std::map<unsigned char, int> kids; int value = -1; };
+    std::vector<Node> nodes(1);
+    std::string pool;
+    for (const auto& r : rules) {
+        int n = 0;
+        for (unsigned char c : r.first) {
+            auto it = nodes[n].kids.find(c);
+            if (it == nodes[n].kids.end()) { nodes[n].kids[c] = (int)nodes.size(); n = (int)nodes.size(); nodes.push_back(Node()); }
+            else n = it->second;
+        }
+        nodes[n].value = (int)pool.size();
+        pool += r.second;
+        pool.push_back('\0');
+    }
+    // 逐个结点找一个未用过的 base，使各子结点 (终止值记作标签 0) 的槽位 base ^ label 都空着
+    std::vector<uint32_t> units(1, 0);
+    std::vector<bool> used(1, true);
+    std::set<uint32_t> bases;
+    std::vector<std::pair<int, uint32_t>> queue(1, std::make_pair(0, 0u));
+    for (size_t q = 0; q < queue.size(); ++q) {
+        const Node& node = nodes[queue[q].first];
+        uint32_t index = queue[q].second;
+        std::vector<unsigned char> labels;
+        if (node.value >= 0) labels.push_back(0);
+        for (const auto& k : node.kids) labels.push_back(k.first);
+        if (labels.empty()) continue;
+        uint32_t base = 1;
+        for (;; ++base) {
+            if (base == index || bases.count(base)) continue;
+            bool free = true;
+            for (unsigned char c : labels) free = free && ((base ^ c) >= used.size() || !used[base ^ c]);
+            if (free) break;
+        }
+        bases.insert(base);
+        units[index] |= (index ^ base) << 10;
+        for (unsigned char c : labels) {
+            uint32_t slot = base ^ c;
+            if (slot >= units.size()) { units.resize(slot + 1, 0); used.resize(slot + 1, false); }
+            used[slot] = true;
+            if (c == 0) { units[slot] = (1U << 31) | (uint32_t)node.value; continue; }
+            int kid = node.kids.at(c);
+            units[slot] = c | (nodes[kid].value >= 0 ? 1U << 8 : 0);
+            queue.push_back(std::make_pair(kid, slot));
+        }
+    }
+    std::string blob;
+    auto put = [&](uint32_t v) { for (int s = 0; s < 32; s += 8) blob.push_back((char)((v >> s) & 0xFF)); };
+    put((uint32_t)units.size() * 4);
+    for (uint32_t u : units) put(u);
+    blob += pool;
+
+    static const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < blob.size(); i += 3) {
+        uint32_t v = (unsigned char)blob[i] << 16;
+        if (i + 1 < blob.size()) v |= (unsigned char)blob[i + 1] << 8;
+        if (i + 2 < blob.size()) v |= (unsigned char)blob[i + 2];
+        out += chars[(v >> 18) & 63];
+        out += chars[(v >> 12) & 63];
+        out += i + 1 < blob.size() ? chars[(v >> 6) & 63] : '=';
+        out += i + 2 < blob.size() ? chars[v & 63] : '=';
+    }
+    return out;
+}
+
+// HF 的 Precompiled 规则在 std::map 上的直接实现: 不足 6 字节的字素簇整体查表，否则逐个码点查表，
+// 查表取命中的最短前缀；没有命中的原样保留
+static std::string precompiled_reference(const std::map<std::string, std::string>& rules, const std::string& text) {
+    auto lookup = [&](const std::string& s, std::string& out) {
+        for (size_t n = 1; n <= s.size(); ++n) {
+            auto it = rules.find(s.substr(0, n));
+            if (it != rules.end()) { out += it->second; return true; }
+        }
+        return false;
+    };
+    auto char_len = [&](size_t i) {
+        int32_t cp;
+        ssize_t r = utf8proc_iterate((const uint8_t*)text.data() + i, text.size() - i, &cp);
+        return r > 0 ? (size_t)r : (size_t)1;
+    };
+    std::string out;
+    for (size_t i = 0; i < text.size();) {
+        int32_t prev, cp;
+        size_t end = i + char_len(i);
+        utf8proc_int32_t state = 0;
+        utf8proc_iterate((const uint8_t*)text.data() + i, text.size() - i, &prev);
+        while (end < text.size()) {
+            ssize_t r = utf8proc_iterate((const uint8_t*)text.data() + end, text.size() - end, &cp);
+            if (r <= 0 || prev < 0 || utf8proc_grapheme_break_stateful(prev, cp, &state)) break;
+            prev = cp;
+            end += r;
+        }
+        std::string cluster = text.substr(i, end - i);
+        if (cluster.size() >= 6 || !lookup(cluster, out)) {
+            for (size_t c = i; c < end;) {
+                size_t n = char_len(c);
+                if (!lookup(text.substr(c, n), out)) out += text.substr(c, n);
+                c += n;
+            }
+        }
+        i = end;
+    }
+    return out;
+}
+
+// Precompiled 规范化器的双数组查表 (多字节源串、嵌套前缀、映射为空串、ASCII 快速路径、长字素簇)
+// 与 std::map 参照一致；没有或无法解析 charsmap 时退回 NFKC 加 ZWJ -> 空格
+static void test_precompiled() {
+    std::map<std::string, std::string> rules = {
+        {"\xEF\xAC\x81", "fi"},                          // ﬁ
+        {"\xEF\xBC\xA1", "A"},                           // Ａ
+        {"\xE2\x91\xA0", "1"},                           // ①
+        {"\xF0\x9D\x90\x80", "A"},                       // 𝐀
+        {"\xE2\x84\xAB", "\xC3\x85"},                    // Å(埃) -> Å
+        {"e\xCC\x81", "\xC3\xA9"},                       // 整个字素簇 e + ◌́
+        {"\xC3\xA9", "E"},                               // é 与更长的 é◌̣ 嵌套: 取最短
+        {"\xC3\xA9\xCC\xA3", "X"},
+        {"\xE1\x84\x80\xE1\x85\xA1", "\xEA\xB0\x80"},    // ᄀ + ᅡ -> 가，单独的 ᄀ 不在表中
+        {"\xCC\xA3", "."},                               // 单独的 ◌̣
+        {"\xE2\x80\x8D", " "},                           // ZWJ
+        {"\t", " "}, {"\r\n", "\n"}, {"q", ""},          // ASCII: 映射、字素簇、删除
+    };
+    PrecompiledNormalizer norm;
+    check(norm.load(precompiled_charsmap(rules)), "Precompiled loads the synthetic charsmap");
+
+    std::vector<std::string> pieces;
+    for (const auto& r : rules) pieces.push_back(r.first);
+    const char* extra[] = {
+        "a", "b", "x", "e", " ", "\r", "\n", "Q", "\xE1\x84\x80", "\xE1\x85\xA1", "\xCC\x81", "\xCC\x81\xCC\x81",
+        "\xE4\xB8\xAD", "\xF0\x9F\x98\x8A", "\xC3\xA9\xCC\x81", "\xFF", "\xC3",
+    };
+    pieces.insert(pieces.end(), extra, extra + sizeof(extra) / sizeof(extra[0]));
+    std::vector<std::string> texts = random_texts(pieces, 4000, 12);
+    texts.insert(texts.end(), pieces.begin(), pieces.end());
+    int mismatches = 0;
+    std::string example;
+    for (const auto& t : texts) {
+        std::string expected = precompiled_reference(rules, t), out, aligned;
+        std::vector<Offset> align;
+        bool ok = norm.normalize_into(t, out) && out == expected;
+        ok = ok && norm.normalize_aligned(t, aligned, align) && aligned == expected && align.size() == aligned.size();
+        if (!ok && mismatches++ == 0) example = t;
+    }
+    check(mismatches == 0, "Precompiled trie lookup equals the std::map reference (" + std::to_string(mismatches) + " mismatches" +
+          (mismatches ? ", e.g. " + escape_bytes(example) : "") + ")");
+
+    // 没有 charsmap、base64 解出的内容不足或大小不对时 load 失败，加载器退回 NFKC + ZWJ -> 空格
+    const char* broken[] = {"", "AAAAAA==", "/////wAAAAA=", "!!!!"};
+    for (const char* b : broken) check(!PrecompiledNormalizer().load(b), std::string("Precompiled rejects charsmap ") + quote(b));
+    std::string vocab = "\"vocab\":[[\"<unk>\",0],[\"f\",-1],[\"i\",-1],[\" \",-1],[\"x\",-1]]";
+    std::string normalizers[] = {
+        "{\"type\":\"Precompiled\"}",
+        "{\"type\":\"Precompiled\",\"precompiled_charsmap\":null}",
+        "{\"type\":\"Precompiled\",\"precompiled_charsmap\":\"AAAAAA==\"}",
+    };
+    for (const auto& n : normalizers) {
+        PreTrainedTokenizer tok;
+        tok.load_from_json_str("{\"normalizer\":" + n + ",\"model\":{\"type\":\"Unigram\",\"unk_id\":0," + vocab + "}}");
+        check(tok.encode("\xEF\xAC\x81\xE2\x80\x8Dx", false) == std::vector<int>({1, 2, 3, 4}),
+              "Precompiled without a usable charsmap falls back to NFKC and ZWJ -> space: " + n);
+    }
+    PreTrainedTokenizer tok;
+    tok.load_from_json_str("{\"normalizer\":{\"type\":\"Precompiled\",\"precompiled_charsmap\":" +
+                           quote(precompiled_charsmap({{"x", "f"}, {"\xE2\x80\x8D", "i"}})) + "},\"model\":{\"type\":\"Unigram\",\"unk_id\":0," + vocab + "}}");
+    check(tok.encode("\xEF\xAC\x81\xE2\x80\x8Dx", false) == std::vector<int>({0, 2, 1}),
+          "Precompiled with a charsmap applies only its own rules");
+}
+
+// 查表之前逐码点调用 utf8proc 的 BertNormalizer: 类别判断、单码点分解去掉 Mn、最后整体转小写
+static std::string bert_reference(const std::string& text, bool clean, bool chinese, bool accents, bool lowercase) {
+    auto is_chinese = [](int32_t cp) {
+        return (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+               (cp >= 0x20000 && cp <= 0x2A6DF) || (cp >= 0x2A700 && cp <= 0x2B73F) ||
+               (cp >= 0x2B740 && cp <= 0x2B81F) || (cp >= 0x2B820 && cp <= 0x2CEAF) ||
+               (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0x2F800 && cp <= 0x2FA1F);
+    };
+    std::string out;
+    const uint8_t* p = (const uint8_t*)text.data();
+    int32_t cp;
+    for (size_t i = 0, r; i < text.size(); i += r) {
+        r = (size_t)utf8proc_iterate(p + i, text.size() - i, &cp);
+        std::string ch = text.substr(i, r);
+        if (clean && (cp == '\t' || cp == '\n' || cp == '\r' || utf8proc_category(cp) == UTF8PROC_CATEGORY_ZS)) { out += ' '; continue; }
+        if (clean && (cp == 0 || cp == 0xFFFD || utf8proc_category(cp) == UTF8PROC_CATEGORY_CC)) continue;
+        if (chinese && is_chinese(cp)) { out += " " + ch + " "; continue; }
+        if (accents) {
+            uint8_t* decomposed = nullptr;
+            ssize_t n = utf8proc_map(p + i, r, &decomposed, UTF8PROC_DECOMPOSE);
+            if (n > 0 && decomposed) {
+                int32_t d;
+                for (ssize_t j = 0, dr; decomposed[j] != 0; j += dr) {
+                    dr = utf8proc_iterate(decomposed + j, -1, &d);
+                    if (utf8proc_category(d) != UTF8PROC_CATEGORY_MN) out.append((const char*)decomposed + j, dr);
+                }
+                free(decomposed);
+                continue;
+            }
+            free(decomposed);
+        }
+        out += ch;
+    }
+    if (!lowercase) return out;
+    std::string lower;
+    p = (const uint8_t*)out.data();
+    for (size_t i = 0, r; i < out.size(); i += r) {
+        r = (size_t)utf8proc_iterate(p + i, out.size() - i, &cp);
+        append_utf8(lower, utf8proc_tolower(cp));
+    }
+    return lower;
+}
+
+// 16 种选项组合下，BertNormalizer 的查表 (BMP) 与逐码点路径 (其余平面) 对每个合法码点都与参照一致；
+// 码点按 256 个一组、以 '|' 隔开送入，对齐表的长度与输出一致
+static void test_bert_normalizer_tables() {
+    for (int options = 0; options < 16; ++options) {
+        bool clean = options & 1, chinese = options & 2, accents = options & 4, lowercase = options & 8;
+        BertNormalizer norm(clean, chinese, accents, lowercase);
+        int bad_blocks = 0;
+        int32_t first_bad = -1;
+        for (int32_t block = 0; block < 0x110000; block += 256) {
+            if (block >= 0xD800 && block < 0xE000) continue;
+            std::string text, out;
+            for (int32_t cp = block; cp < block + 256; ++cp) { append_utf8(text, cp); text += '|'; }
+            std::vector<Offset> align;
+            std::string expected = bert_reference(text, clean, chinese, accents, lowercase);
+            bool ok = (norm.normalize_into(text, out) ? out : text) == expected;
+            ok = ok && (norm.normalize_aligned(text, out, align) ? out : text) == expected && (align.empty() || align.size() == out.size());
+            if (!ok && bad_blocks++ == 0) first_bad = block;
+        }
+        char hex[16];
+        snprintf(hex, sizeof(hex), "U+%04X", first_bad);
+        check(bad_blocks == 0, "BertNormalizer(clean=" + std::to_string(clean) + ", chinese=" + std::to_string(chinese) +
+              ", strip_accents=" + std::to_string(accents) + ", lowercase=" + std::to_string(lowercase) +
+              ") equals the per-code-point utf8proc logic on every code point" + (bad_blocks ? " (first differing block " + std::string(hex) + ")" : ""));
+    }
+}
+
+// BERT 流水线的 tokenizer.json: 小写 a-m 及其 ## 续接、几个整词和标点，n-z 与数字无法切分
+static std::string bert_json(bool with_unk) {
+    std::vector<std::string> tokens = {"[CLS]", "[SEP]", "the", "##ing", "run", "##ning", ".", ",", "!", "\xE4\xB8\xAD", "\xE6\x96\x87", "##"};
+    if (with_unk) tokens.insert(tokens.begin(), "[UNK]");
+    for (char c = 'a'; c <= 'm'; ++c) {
+        tokens.push_back(std::string(1, c));
+        tokens.push_back("##" + std::string(1, c));
+    }
+    std::string vocab;
+    for (size_t i = 0; i < tokens.size(); ++i) vocab += (i ? "," : "") + quote(tokens[i]) + ":" + std::to_string(i);
+    return "{\"model\":{\"type\":\"WordPiece\",\"unk_token\":\"[UNK]\",\"continuing_subword_prefix\":\"##\","
+           "\"max_input_chars_per_word\":10,\"vocab\":{" + vocab + "}},"
+           "\"normalizer\":{\"type\":\"BertNormalizer\",\"clean_text\":true,\"handle_chinese_chars\":true,"
+           "\"strip_accents\":null,\"lowercase\":true},"
+           "\"pre_tokenizer\":{\"type\":\"BertPreTokenizer\"}}";
+}
+
+// 词表没有 unk 时，过长或无法切分的词 (包括以续接前缀开头、走回退匹配的词) 不产生 id，
+// 其余词照常切分；有 unk 时同样的词得到单个 unk
+static void test_wordpiece_no_unk() {
+    for (bool with_unk : {false, true}) {
+        std::string vocab = "{\"a\":0,\"b\":1,\"##a\":2,\"##b\":3,\"ab\":4,\"##\":5";
+        if (with_unk) vocab += ",\"[UNK]\":6";
+        WordPieceModel model("[UNK]", "##", 6);
+        model.load(json::parse(vocab + "}"));
+        std::vector<int> unk;
+        if (with_unk) unk.push_back(6);
+        std::string label = with_unk ? " (with [UNK])" : " (no unk token)";
+        check(model.tokenize("abab") == std::vector<int>({4, 2, 3}), "WordPiece splits a matching word" + label);
+        check(model.tokenize("abc") == unk, "WordPiece unsplittable word" + label);
+        check(model.tokenize("ca") == unk, "WordPiece word failing on its first piece" + label);
+        check(model.tokenize("abababa") == unk, "WordPiece word over max_input_chars_per_word" + label);
+        check(model.tokenize("##ax") == unk, "WordPiece fallback matcher on a prefixed word" + label);
+        std::vector<int> out(1, 42);
+        model.tokenize_into("abc", out);
+        check(out.size() == 1 + unk.size() && out[0] == 42, "WordPiece failure keeps earlier ids" + label);
+    }
+}
+
+// encode() 走融合的 BertWordPieceEncoder，encode_with_offsets() 走逐步的 normalizer/pre-tokenizer/model
+static void test_bert_fused() {
+    const char* pieces[] = {
+        "a", "b", "m", "the", "running", "x", "z", "7", "A", "THE", "Run", "\xC3\xA9", "\xC3\x89", "e\xCC\x81",
+        "\xE4\xB8\xAD", "\xE6\x96\x87", "\xE5\xAD\x97", "\xE3\x80\x82", ".", ",", "!", "##", "#", " ", "  ", "\t", "\n",
+        "\x01", "\xC2\xA0", "\xE2\x80\x8B", "abcdefghijklm", "\xFF",
+    };
+    const size_t n_pieces = sizeof(pieces) / sizeof(pieces[0]);
+    std::mt19937 rng(7);
+    for (bool with_unk : {true, false}) {
+        PreTrainedTokenizer tok;
+        tok.load_from_json_str(bert_json(with_unk));
+        int mismatches = 0, unks = 0;
+        for (int i = 0; i < 3000; ++i) {
+            std::string t;
+            for (int k = 1 + rng() % 16; k > 0; --k) t += pieces[rng() % n_pieces];
+            std::vector<Offset> offsets;
+            std::vector<int> fused = tok.encode(t, false);
+            if (fused != tok.encode_with_offsets(t, offsets, false)) mismatches++;
+            for (int id : fused) if (id == tok.token_to_id("[UNK]") || id < 0) unks++;
+        }
+        std::string label = with_unk ? " (with [UNK])" : " (no unk token)";
+        check(mismatches == 0, "fused BERT encoder equals the unfused pipeline" + label);
+        check(with_unk ? unks > 0 : unks == 0, "unsplittable and too long words give unk, or nothing without one" + label);
+    }
+}
+
+// 每个 token 的偏移应正好是它拼出的那段输入: 字节级 BPE 的原始字节、WordPiece 去掉续接前缀的片段 (小写)、
+// Unigram 的词片，连续的 unk 合并成一段
+static void test_offsets() {
+    PreTrainedTokenizer bpe;
+    bpe.load_from_json_str(bpe_json(toy_bpe()));
+    int bad = 0;
+    std::mt19937 rng(8);
+    std::vector<std::string> words = make_corpus(2000, 9);
+    for (int i = 0; i < 300; ++i) {
+        std::string t;
+        for (int k = 1 + rng() % 10; k > 0; --k) t += words[rng() % words.size()] + (rng() % 3 ? " " : "  ");
+        std::vector<Offset> offsets;
+        std::vector<int> ids = bpe.encode_with_offsets(t, offsets, false);
+        size_t pos = 0;
+        for (size_t k = 0; k < ids.size(); ++k) {
+            if (offsets[k].first != pos || t.substr(pos, offsets[k].second - pos) != raw_bytes(bpe.id_to_token(ids[k]))) bad++;
+            pos = offsets[k].second;
+        }
+        if (ids != bpe.encode(t, false) || pos != t.size()) bad++;
+    }
+    check(bad == 0, "byte-level BPE offsets cover each token's own bytes, in order");
+
+    PreTrainedTokenizer wp;
+    wp.load_from_json_str(bert_json(true));
+    std::vector<Offset> offsets;
+    std::string text = "The running, Cab! xyz abcdefghijklm";
+    std::vector<int> ids = wp.encode_with_offsets(text, offsets, false);
+    std::string got;
+    for (size_t k = 0; k < ids.size(); ++k) {
+        got += "[" + wp.id_to_token(ids[k]) + "]=" + text.substr(offsets[k].first, offsets[k].second - offsets[k].first) + " ";
+    }
+    check(got == "[the]=The [run]=run [##ning]=ning [,]=, [c]=C [##a]=a [##b]=b [!]=! [[UNK]]=xyz [[UNK]]=abcdefghijklm ",
+          "WordPiece offsets: pieces after the prefix, unk words whole, got " + got);
+
+    PreTrainedTokenizer uni;
+    uni.load_from_json_str("{\"model\":{\"type\":\"Unigram\",\"unk_id\":0,\"vocab\":[[\"<unk>\",0],[\"a\",-2],[\"ab\",-1],"
+                           "[\"abc\",-5],[\"b\",-2],[\"c\",-2],[\"\xE4\xB8\xAD\",-1]]}}");
+    text = "abcxyzab\xE4\xB8\xAD\xE6\x96\x87q";
+    ids = uni.encode_with_offsets(text, offsets, false);
+    got.clear();
+    for (size_t k = 0; k < ids.size(); ++k) {
+        got += "[" + uni.id_to_token(ids[k]) + "]=" + text.substr(offsets[k].first, offsets[k].second - offsets[k].first) + " ";
+    }
+    check(got == "[ab]=ab [c]=c [<unk>]=xyz [ab]=ab [\xE4\xB8\xAD]=\xE4\xB8\xAD [<unk>]=\xE6\x96\x87q ",
+          "Unigram offsets: lattice pieces, runs of unknown characters merged, got " + got);
+}
+
+// Unigram 的 Viterbi: 短 pre-token 用每线程复用的格，超过保留上限的用临时格；
+// 两种长度交替编码都与直接实现的最大得分切分一致
+static void test_unigram_lattice() {
+    const char* pieces[] = {"a", "b", "c", "ab", "bc", "abc", "ca", "bca"};
+    double scores[] = {-3.0, -3.5, -4.0, -4.25, -5.125, -5.5, -6.0, -6.75};
+    std::string vocab = "[[\"<unk>\",0]";
+    for (int k = 0; k < 8; ++k) vocab += ",[" + quote(pieces[k]) + "," + std::to_string(scores[k]) + "]";
+    UnigramModel model(0, false);
+    model.load(json::parse(vocab + "]"));
+
+    auto reference = [&](const std::string& t) {
+        std::vector<double> best(t.size() + 1, -1e18);
+        std::vector<int> id(t.size() + 1), prev(t.size() + 1);
+        best[0] = 0;
+        for (size_t i = 1; i <= t.size(); ++i) {
+            for (int k = 0; k < 8; ++k) {
+                size_t len = strlen(pieces[k]);
+                if (len > i || t.compare(i - len, len, pieces[k]) != 0 || best[i - len] + scores[k] <= best[i]) continue;
+                best[i] = best[i - len] + scores[k];
+                id[i] = k + 1;
+                prev[i] = (int)(i - len);
+            }
+        }
+        std::vector<int> out;
+        for (size_t i = t.size(); i > 0; i = prev[i]) out.push_back(id[i]);
+        std::reverse(out.begin(), out.end());
+        return out;
+    };
+    std::mt19937 rng(17);
+    int bad = 0;
+    for (size_t len : {5, 40000, 300, 16383, 16384, 17, 100000, 1000}) {
+        std::string t;
+        while (t.size() < len) t += "abc"[rng() % 3];
+        if (model.tokenize(t) != reference(t)) bad++;
+    }
+    check(bad == 0, "Unigram Viterbi equals the reference on short and oversize pre-tokens (" + std::to_string(bad) + " mismatches)");
+}
+
+// 预分词的两个入口: encode() 用的流式 pre_tokenize_stream 与带偏移路径用的 pre_tokenize (SplitBuilder/Span)
+// 在随机文本上给出相同的片段；嵌套的 Sequence 各层借用自己的 StreamBuffer
+static void test_stream_pre_tokenize() {
+    auto seq = [](std::vector<std::shared_ptr<PreTokenizer>> pts) { return std::make_shared<SequencePreTokenizer>(pts); };
+    auto raw = std::make_shared<ByteLevelPreTokenizer>(true);
+    raw->set_emit_raw_bytes(true);
+    const char* llama3 = "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+    struct { std::string name; std::shared_ptr<PreTokenizer> pt; } cases[] = {
+        {"ByteLevel regex", std::make_shared<ByteLevelPreTokenizer>(true)},
+        {"ByteLevel no regex", std::make_shared<ByteLevelPreTokenizer>(false)},
+        {"ByteLevel raw bytes", raw},
+        {"Metaspace prefix", std::make_shared<MetaspacePreTokenizer>("\xE2\x96\x81", true)},
+        {"Metaspace", std::make_shared<MetaspacePreTokenizer>("\xE2\x96\x81", false)},
+        {"Split scanner", std::make_shared<SplitPreTokenizer>(llama3, false)},
+        {"Split DFA inverted", std::make_shared<SplitPreTokenizer>("\\p{L}+|\\p{N}", true)},
+        {"Split removed", std::make_shared<SplitPreTokenizer>("\\s+", false, "Removed")},
+        {"Split Oniguruma", std::make_shared<SplitPreTokenizer>("(?<=a)b|\\s", false)},
+        {"Digits individual", std::make_shared<DigitsPreTokenizer>(true)},
+        {"Digits", std::make_shared<DigitsPreTokenizer>(false)},
+        {"Bert", std::make_shared<BertPreTokenizer>()},
+        {"Sequence Split+ByteLevel", seq({std::make_shared<SplitPreTokenizer>(llama3, false), std::make_shared<ByteLevelPreTokenizer>(false)})},
+        {"Sequence Bert+Digits", seq({std::make_shared<BertPreTokenizer>(), std::make_shared<DigitsPreTokenizer>(true)})},
+        {"Sequence Metaspace+Split", seq({std::make_shared<MetaspacePreTokenizer>("\xE2\x96\x81", true), std::make_shared<SplitPreTokenizer>("\xE2\x96\x81", false, "Removed")})},
+        {"Sequence Digits+ByteLevel regex", seq({std::make_shared<DigitsPreTokenizer>(true), std::make_shared<ByteLevelPreTokenizer>(true)})},
+        {"nested Sequence", seq({seq({std::make_shared<BertPreTokenizer>(), std::make_shared<MetaspacePreTokenizer>("_", true)}),
+                                 std::make_shared<DigitsPreTokenizer>(true), std::make_shared<ByteLevelPreTokenizer>(false)})},
+    };
+    std::vector<std::string> pieces = {
+        "a", "ab", "Hello", "I'm", "'LL", " ", "  ", "\t", "\n", "\r\n", "1", "123", "4567", ",", "...", "!?", "$",
+        "\xC3\xA9", "e\xCC\x81", "\xE4\xB8\xAD\xE6\x96\x87", "\xED\x95\x9C", "\xF0\x9F\x98\x8A", "\xE2\x96\x81", "\xC2\xA0", "_", "b",
+    };
+    std::vector<std::string> texts = random_texts(pieces, 1500, 19);
+    texts.push_back("");
+    for (const auto& c : cases) {
+        int bad = 0;
+        std::string example;
+        for (const auto& t : texts) {
+            PreTokenizedString pts;
+            pts.reset(t);
+            c.pt->pre_tokenize(pts);
+            std::vector<std::string> batch, stream;
+            for (size_t k = 0; k < pts.splits.size(); ++k) batch.push_back(std::string(pts.data(k), pts.size(k)));
+            c.pt->pre_tokenize_stream(t.data(), t.size(), [&](const char* s, size_t n) { stream.push_back(std::string(s, n)); });
+            if (batch != stream && bad++ == 0) example = t;
+        }
+        check(bad == 0, "streaming pre-tokens equal the batch split for " + c.name + (bad ? " (differs on " + quote(example) + ")" : ""));
+    }
+
+    // 嵌套的 SequenceNormalizer 复用每线程的暂存串: 反复调用、对齐与不对齐的结果都等于逐个阶段执行
+    std::vector<std::shared_ptr<Normalizer>> inner = {std::make_shared<BertNormalizer>(true, true, true, true), std::make_shared<ReplaceNormalizer>(" ", "_")};
+    std::vector<std::shared_ptr<Normalizer>> stages = {
+        std::make_shared<ReplaceNormalizer>("I", "i"), std::make_shared<SequenceNormalizer>(inner), std::make_shared<NFKCNormalizer>(),
+    };
+    SequenceNormalizer norm(stages);
+    int bad = 0;
+    for (int round = 0; round < 2; ++round) {
+        for (const auto& t : texts) {
+            std::string expected = t, out, aligned;
+            for (const auto& s : {stages[0], inner[0], inner[1], stages[2]}) {
+                std::string next;
+                if (s->normalize_into(expected, next)) expected.swap(next);
+            }
+            std::vector<Offset> align;
+            bool ok = (norm.normalize_into(t, out) ? out : t) == expected;
+            ok = ok && (norm.normalize_aligned(t, aligned, align) ? aligned : t) == expected && (align.empty() || align.size() == aligned.size());
+            if (!ok) bad++;
+        }
+    }
+    check(bad == 0, "nested SequenceNormalizer equals its stages run one by one (" + std::to_string(bad) + " mismatches)");
+}
+
+// 内置的常见切分正则: 缩写 (大小写)、数字串、换行前的空白、非拉丁文字与组合符号
+static void test_pattern_scanner() {
+    const char* patterns[] = {
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+",
+        "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        "[!\\\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\\r\\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+        "\\p{N}{1,3}",
+        "[\xE4\xB8\x80-\xE9\xBE\xA5\xE3\x81\x80-\xE3\x82\x9F\xE3\x82\xA0-\xE3\x83\xBF]+",
+        "\\s+",
+    };
+    std::vector<std::string> pieces = {
+        "'s", "'S", "'t", "'re", "'RE", "'Ve", "'m", "'ll", "'LL", "'d", "'x", "'", "don", "I",
+        "1", "12", "123", "4567", "\xD9\xA3\xD9\xA4", "\xE2\x85\xA0", "\xC2\xB2",
+        " ", "  ", "\t", "\n", "\r\n", "\r", " \n", "  \n\n", "\xC2\xA0", "\xE3\x80\x80", "\xE2\x80\xA8",
+        "a", "Hello", "\xC3\x89t\xC3\xA9", "\xE4\xB8\xAD\xE6\x96\x87", "\xE3\x81\xB2\xE3\x82\x89", "\xE3\x82\xAB\xE3\x82\xBF",
+        "\xED\x95\x9C", "\xD0\xBA\xD0\xBE\xD1\x82", "\xD8\xA7\xD9\x84\xD8\xB9", "\xE0\xA4\x95\xE0\xA4\xBF",
+        "e\xCC\x81", "\xCC\x81", "\xE2\x83\x9D", "!", "...", ",", "\xE2\x80\x94", "$", "+=", "\xF0\x9F\x98\x8A", "(", "\\", "\"",
+    };
+    std::vector<std::string> texts = random_texts(pieces, 4000, 10);
+    for (const char* pattern : patterns) {
+        auto scanner = PatternScanner::find(pattern);
+        if (!scanner) { check(false, std::string("no scanner for ") + pattern); continue; }
+        std::string example;
+        int n = split_mismatches(pattern, *scanner, texts, example);
+        check(n == 0, std::string("scanner splits like Oniguruma: ") + pattern + (n ? " (differs on " + quote(example) + ")" : ""));
+    }
+}
+
+// 编译成 DFA 的切分正则: Unicode 类别与区间、最左优先的分支、前瞻排除；不支持的写法交给 Oniguruma
+static void test_regex_dfa() {
+    const char* patterns[] = {
+        "\\p{L}+|\\p{N}+|[^\\s\\p{L}\\p{N}]+",
+        "\\p{Lu}\\p{Ll}*|\\p{Ll}+",
+        "[\\p{P}\\p{S}]+|\\p{M}+",
+        "[^\\p{L}\\p{N}]+",
+        "[\\x{0430}-\\x{044F}\\x{0451}]+",
+        "[\\p{Han}]+|[\\p{Hiragana}\\p{Katakana}]+",
+        "ab|abc|a",
+        "abc|ab|a",
+        "\\d+|\\d+\\.\\d+",
+        "(?i:abc|ab)",
+        " ?\\p{L}+(?=\\s)|\\s+",
+        "\\s+(?!\\S)|\\s+",
+        "\\p{N}{1,3}(?!\\p{N})|\\p{N}+",
+        "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
+        "|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
+        "|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    };
+    std::vector<std::string> pieces = {
+        "a", "b", "c", "ab", "abc", "ABC", "Ab", "x", "1", "12", "3.5", ".", " ", "  ", "\t", "\n", "\r\n",
+        "\xC3\x89", "\xC3\xA9", "\xD0\x9A\xD0\xBE\xD1\x82", "\xD1\x91", "\xE4\xB8\xAD\xE6\x96\x87", "\xE3\x81\xB2", "\xE3\x82\xAB",
+        "\xED\x95\x9C", "\xCC\x81", "\xE0\xA4\x95\xE0\xA4\xBF", "'s", "'LL", "!", "\xE2\x80\x94", "$", "/", "\xF0\x9F\x98\x8A",
+        "\xC7\x85", "\xCA\xB0", "\xD9\xA3", "\xC2\xA0",
+    };
+    std::vector<std::string> texts = random_texts(pieces, 3000, 11);
+    for (const char* pattern : patterns) {
+        auto dfa = RegexDFA::compile(pattern);
+        if (!dfa) { check(false, std::string("DFA compiles ") + pattern); continue; }
+        std::string example;
+        int n = split_mismatches(pattern, *dfa, texts, example);
+        check(n == 0, std::string("DFA splits like Oniguruma: ") + pattern + (n ? " (differs on " + quote(example) + ")" : ""));
+    }
+
+    // 长串上失败的扫描 (a+b 遇不到 b、前瞻在结尾不成立、按奇偶交替的状态): 结果与 Oniguruma 一致，
+    // 且每段只读一遍，10 万字节的失败串不应随起点数平方增长
+    const char* failing[] = {"a+b", "\\s+(?=\\S)", "(?:aa)+b|c", " ?\\p{L}+(?=\\s)|\\d"};
+    std::vector<std::string> runs;
+    std::mt19937 rng(13);
+    for (int i = 0; i < 200; ++i) {
+        std::string t;
+        for (int k = 1 + rng() % 4; k > 0; --k) {
+            const char* unit[] = {"a", " ", "b", "c", "x", "1", "\xC3\xA9"};
+            std::string u = unit[rng() % 7];
+            for (int r = rng() % 300; r > 0; --r) t += u;
+        }
+        runs.push_back(t);
+    }
+    for (const char* pattern : failing) {
+        auto dfa = RegexDFA::compile(pattern);
+        if (!dfa) { check(false, std::string("DFA compiles ") + pattern); continue; }
+        std::string example;
+        int n = split_mismatches(pattern, *dfa, runs, example);
+        check(n == 0, std::string("DFA splits long runs like Oniguruma: ") + pattern + (n ? " (differs on " + quote(example) + ")" : ""));
+    }
+    struct { const char* pattern; std::string text; int start, end; } longest[] = {
+        {"a+b", std::string(100000, 'a'), -1, -1},
+        {"a+b", std::string(100000, 'a') + "b", 0, 100001},
+        {"\\s+(?=\\S)", "x" + std::string(100000, ' '), -1, -1},
+        {"(?:aa)+b|c", std::string(100000, 'a') + "c", 100000, 100001},
+    };
+    for (const auto& l : longest) {
+        auto dfa = RegexDFA::compile(l.pattern);
+        if (!dfa) { check(false, std::string("DFA compiles ") + l.pattern); continue; }
+        int b = -1, e = -1;
+        auto t0 = std::chrono::steady_clock::now();
+        bool found = dfa->search(l.text.data(), l.text.size(), 0, (int)l.text.size(), b, e);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        check(found == (l.start >= 0) && (!found || (b == l.start && e == l.end)),
+              std::string("DFA search on a 100000-byte run: ") + l.pattern);
+        check(ms < 1000, std::string("DFA search reads a failing run once: ") + l.pattern + " took " + std::to_string((int)ms) + " ms");
+    }
+
+    // 反向引用、占有量词、非贪婪计数、后顾、可匹配空串: 没有 matcher，SplitPreTokenizer 仍按 Oniguruma 切分
+    const char* unsupported[] = {"(a)\\1", "a*+", "a{2}?", "(?<=a)b", "a*", "\\bab"};
+    for (const char* pattern : unsupported) {
+        check(!SplitMatcher::find(pattern), std::string("no matcher for ") + pattern);
+        SplitPreTokenizer split(pattern, false);
+        tokenizer::OnigRegex regex(pattern);
+        int bad = 0;
+        for (size_t i = 0; i < 300; ++i) {
+            const std::string& t = texts[i];
+            PreTokenizedString pts;
+            pts.reset(t);
+            split.pre_tokenize(pts);
+            // 期望: Oniguruma 的匹配与其间的文本依次成段 (Isolated)
+            std::vector<std::string> expected, got;
+            int pos = 0;
+            for (const auto& m : split_matches(regex, nullptr, t)) {
+                if (m.first > pos) expected.push_back(t.substr(pos, m.first - pos));
+                if (m.second > m.first) expected.push_back(t.substr(m.first, m.second - m.first));
+                pos = m.second > m.first ? m.second : m.second + 1;
+            }
+            if (pos < (int)t.size()) expected.push_back(t.substr(pos));
+            for (size_t k = 0; k < pts.splits.size(); ++k) got.push_back(std::string(pts.data(k), pts.size(k)));
+            if (got != expected) bad++;
+        }
+        check(bad == 0, std::string("Split pre-tokenizer falls back to Oniguruma for ") + pattern);
+    }
+}
+
+// ==================== 主函数 ====================
+
+int main() {
+    struct { const char* name; void (*fn)(); } tests[] = {
+        {"model_memory_usage", test_model_memory_usage},
+        {"word_cache", test_word_cache},
+        {"cache_api", test_cache_api},
+        {"backtracking_matches_merge", test_backtracking_matches_merge},
+        {"vocab_ranks", test_vocab_ranks},
+        {"parallel_encode", test_parallel_encode},
+        {"double_array_trie", test_double_array_trie},
+        {"nfkc", test_nfkc},
+        {"precompiled", test_precompiled},
+        {"bert_normalizer_tables", test_bert_normalizer_tables},
+        {"replace_fusion", test_replace_fusion},
+        {"wordpiece_no_unk", test_wordpiece_no_unk},
+        {"bert_fused", test_bert_fused},
+        {"offsets", test_offsets},
+        {"unigram_lattice", test_unigram_lattice},
+        {"stream_pre_tokenize", test_stream_pre_tokenize},
+        {"pattern_scanner", test_pattern_scanner},
+        {"regex_dfa", test_regex_dfa},
+    };
+    for (const auto& t : tests) {
+        int before = g_failed;
+        t.fn();
+        std::cout << (g_failed == before ? "\033[32m[PASS]\033[0m " : "\033[31m[FAIL]\033[0m ") << t.name << std::endl;
+    }
+    std::cout << "checks passed: " << g_passed << ", failed: " << g_failed << std::endl;
+    return g_failed == 0 ? 0 : 1;
+}